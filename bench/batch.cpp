@@ -0,0 +1,227 @@
+#include "ngx.hpp"
+
+#include "batch_exporter.hpp"
+#include "bench.hpp"
+
+#include <random>
+
+#include <zlib.h>
+
+// nginx core isn't linked, the exporter only logs through it
+extern "C" {
+
+void ngx_log_error_core(ngx_uint_t level, ngx_log_t* log, ngx_err_t err,
+    const char* fmt, ...)
+{
+}
+
+}
+
+namespace {
+
+ngx_log_t gLog;
+ngx_cycle_t gCycle;
+
+}
+
+volatile ngx_cycle_t* ngx_cycle = &gCycle;
+
+namespace {
+
+// Calls back right away, as if each request was sent instantly. Batches are
+// encoded on the adding thread, unless 'encode' is off.
+class NullClient : public ExportClient {
+public:
+    void send(RequestCb getRequest, ResponseCb cb) override
+    {
+        if (encode) {
+            auto data = getRequest();
+            bench::keep(data);
+
+            if (requests) {
+                requests->emplace_back(data.data(), data.size());
+            }
+        }
+
+        cb(grpc::ByteBuffer(), grpc::Status::OK);
+    }
+
+    bool encode{true};
+    std::vector<std::string>* requests{nullptr};
+};
+
+// spans with the default attribute set of a plain HTTP request
+class SpanSource {
+public:
+    SpanSource()
+    {
+        route.add("http.route", "/api/v1/items");
+        route.add("http.scheme", "http");
+
+        for (int i = 0; i < 4096; i++) {
+            targets.push_back("/api/v1/items/" + std::to_string(rng()) +
+                "?page=" + std::to_string(rng() % 100));
+            peers.push_back("10.0." + std::to_string(rng() % 256) + "." +
+                std::to_string(rng() % 256));
+        }
+    }
+
+    bool add(BatchExporter& exporter)
+    {
+        auto n = next++;
+
+        BatchExporter::SpanInfo info{"/api/v1/items",
+            TraceContext::generate(true), {},
+            1700000000000000000 + n * 1000000,
+            1700000000000000000 + n * 1000000 + rng() % 50000000};
+
+        return exporter.add(info, [&](BatchExporter::Span& span) {
+            span.add("http.method", "GET");
+            span.add("http.target", targets[n % targets.size()]);
+            span.addEncoded(route.data());
+            span.add("http.flavor", "1.1");
+            span.add("http.user_agent", UserAgents[n % 3]);
+            span.add("http.request_content_length", 0);
+            span.add("http.response_content_length", rng() % 20000);
+            span.add("http.status_code", n % 50 ? 200 : 404);
+            span.add("net.host.port", 8080);
+            span.add("net.sock.peer.addr", peers[n % peers.size()]);
+            span.add("net.sock.peer.port", 32768 + rng() % 28000);
+        });
+    }
+
+private:
+    static const StrView UserAgents[3];
+
+    BatchExporter::EncodedAttrs route;
+    std::vector<std::string> targets;
+    std::vector<std::string> peers;
+    std::minstd_rand rng;
+    uint64_t next{0};
+};
+
+const StrView SpanSource::UserAgents[] = {
+    "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0",
+    "curl/8.5.0",
+    "Go-http-client/1.1"
+};
+
+void run(const char* name, bool encode)
+{
+    static const size_t Count = 200000;
+
+    // nothing is logged at level 0
+    gCycle.log = &gLog;
+
+    auto client = new NullClient();
+    client->encode = encode;
+
+    BatchExporter exporter(std::unique_ptr<ExportClient>(client), 512, 4,
+        {{"service.name", "bench"}});
+
+    SpanSource source;
+
+    // buffers grow to their steady size
+    for (size_t i = 0; i < 4 * 512; i++) {
+        source.add(exporter);
+    }
+
+    auto allocs = bench::allocations();
+
+    auto time = bench::measure(Count, [&]() {
+        source.add(exporter);
+    });
+
+    bench::report(std::string(name) + " time", time, "ns/span");
+    bench::report(std::string(name) + " allocations",
+        (double)(bench::allocations() - allocs) / Count, "/span");
+}
+
+// compressed size of 'data', the way gRPC compresses messages: default
+// level and window
+size_t pack(const std::string& data, int windowBits, std::string& out)
+{
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+
+    out.resize(deflateBound(&zs, data.size()));
+
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    return zs.total_out;
+}
+
+// Sizes and CPU cost of export requests per 'compression' method, from
+// full batches of the default span set.
+void runCompress()
+{
+    static const size_t BatchSize = 512;
+    static const size_t Batches = 20;
+
+    gCycle.log = &gLog;
+
+    std::vector<std::string> requests;
+
+    auto client = new NullClient();
+    client->requests = &requests;
+
+    {
+        BatchExporter exporter(std::unique_ptr<ExportClient>(client),
+            BatchSize, 4, {{"service.name", "bench"}});
+
+        SpanSource source;
+
+        for (size_t i = 0; i < Batches * BatchSize; i++) {
+            source.add(exporter);
+        }
+    }
+
+    static const struct {
+        const char* name;
+        int windowBits;
+    } Methods[] = {
+        {"none", 0},
+        {"deflate", 15},
+        {"gzip", 15 + 16}
+    };
+
+    size_t spans = requests.size() * BatchSize;
+    std::string out;
+
+    for (auto& m : Methods) {
+        size_t n = 0;
+        size_t bytes = 0;
+
+        auto time = bench::measure(requests.size(), [&]() {
+            auto& data = requests[n++];
+
+            bytes += m.windowBits ? pack(data, m.windowBits, out) : data.size();
+        });
+
+        auto name = std::string("batch.compress ") + m.name;
+
+        bench::report(name + " size", (double)bytes / spans, "bytes/span");
+        bench::report(name + " time", time / BatchSize, "ns/span");
+    }
+}
+
+bench::Register add("batch.add", []() {
+    run("batch.add", false);
+});
+
+bench::Register encode("batch.add+encode", []() {
+    run("batch.add+encode", true);
+});
+
+bench::Register compress("batch.compress", runCompress);
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal runner for microbenchmarks of the module internals. Each one
+// registers itself and reports figures of its own.
+namespace bench {
+
+typedef std::function<void ()> Fn;
+
+inline std::vector<std::pair<std::string, Fn>>& registry()
+{
+    static std::vector<std::pair<std::string, Fn>> benchmarks;
+    return benchmarks;
+}
+
+struct Register {
+    Register(const char* name, Fn fn)
+    {
+        registry().emplace_back(name, fn);
+    }
+};
+
+// heap allocations made by the process so far
+size_t allocations();
+
+// keeps 'value' from being optimized out
+template <class T>
+void keep(const T& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// in nanoseconds per call
+template <class F>
+double measure(size_t count, F fn)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < count; i++) {
+        fn();
+    }
+
+    std::chrono::duration<double, std::nano> time =
+        std::chrono::steady_clock::now() - start;
+
+    return time.count() / count;
+}
+
+inline void report(const std::string& name, double value, const char* unit)
+{
+    std::printf("%-44s %12.2f %s\n", name.c_str(), value, unit);
+}
+
+}
@@ -0,0 +1,330 @@
+#include <array>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "trace_context.hpp"
+
+namespace {
+
+using namespace opentelemetry::trace::propagation;
+
+// TraceContext::parse() and serialize() as they were with SDK helpers
+
+TraceContext sdkParse(StrView trace, StrView state)
+{
+    std::array<StrView, 4> parts;
+    if (detail::SplitString(trace, '-', parts.data(), 4) != 4) {
+        return TraceContext{};
+    }
+
+    auto version = parts[0];
+    auto traceId = parts[1];
+    auto spanId = parts[2];
+    auto flags = parts[3];
+
+    if (version != "00") {
+        return TraceContext{};
+    }
+
+    if (traceId.size() != kTraceIdSize || spanId.size() != kSpanIdSize ||
+        flags.size() != kTraceFlagsSize)
+    {
+        return TraceContext{};
+    }
+
+    if (!detail::IsValidHex(traceId) || !detail::IsValidHex(spanId) ||
+        !detail::IsValidHex(flags))
+    {
+        return TraceContext{};
+    }
+
+    return {HttpTraceContext::TraceIdFromHex(traceId),
+            HttpTraceContext::SpanIdFromHex(spanId),
+            HttpTraceContext::TraceFlagsFromHex(flags).IsSampled(),
+            state};
+}
+
+void sdkSerialize(const TraceContext& tc, char* out)
+{
+    *out++ = '0';
+    *out++ = '0';
+    *out++ = '-';
+
+    tc.traceId.ToLowerBase16({out, kTraceIdSize});
+    out += kTraceIdSize;
+    *out++ = '-';
+
+    tc.spanId.ToLowerBase16({out, kSpanIdSize});
+    out += kSpanIdSize;
+    *out++ = '-';
+
+    *out++ = '0';
+    *out++ = tc.sampled ? '1' : '0';
+}
+
+bool same(const TraceContext& a, const TraceContext& b)
+{
+    return a.traceId == b.traceId && a.spanId == b.spanId &&
+        a.sampled == b.sampled;
+}
+
+// traceparent headers: plain, uppercase, with a field after the flags and
+// with a non-hex digit
+std::vector<std::string> headers()
+{
+    std::vector<std::string> result;
+
+    for (int i = 0; i < 1024; i++) {
+        char buf[TraceContext::Size];
+        TraceContext::serialize(TraceContext::generate(i % 2), buf);
+
+        std::string header(buf, sizeof(buf));
+
+        switch (i % 4) {
+        case 1:
+            for (auto& c : header) {
+                c = std::toupper(c);
+            }
+            break;
+
+        case 2:
+            header += "-00";
+            break;
+
+        case 3:
+            header[3 + i % 50] = 'g';
+            break;
+        }
+
+        result.push_back(header);
+    }
+
+    return result;
+}
+
+// decodeHex() as it was with SDK helpers
+bool sdkDecode(const char* in, uint8_t* out, size_t size)
+{
+    StrView hex(in, size * 2);
+    return detail::IsValidHex(hex) && detail::HexToBinary(hex, out, size);
+}
+
+void fail(const char* what, std::string in)
+{
+    for (auto& c : in) {
+        if (!std::isprint((unsigned char)c)) {
+            c = '?';
+        }
+    }
+
+    std::fprintf(stderr, "%s mismatch on \"%s\"\n", what, in.c_str());
+    std::exit(1);
+}
+
+const size_t MaxSize = 40;
+
+void checkDecode(const std::string& in)
+{
+    uint8_t a[MaxSize];
+    uint8_t b[MaxSize];
+
+    size_t size = in.size() / 2;
+
+    bool ok = decodeHex(in.data(), a, size);
+
+    if (ok != sdkDecode(in.data(), b, size) ||
+        (ok && std::memcmp(a, b, size) != 0))
+    {
+        fail("decode", in);
+    }
+}
+
+// lowercase digits that decode back
+void checkEncode(const std::vector<uint8_t>& in)
+{
+    char out[MaxSize * 2];
+    encodeHex(in.data(), in.size(), out);
+
+    std::string hex(out, in.size() * 2);
+    uint8_t back[MaxSize];
+
+    if (hex.find_first_not_of("0123456789abcdef") != std::string::npos ||
+        !sdkDecode(hex.data(), back, in.size()) ||
+        std::memcmp(back, in.data(), in.size()) != 0)
+    {
+        fail("encode", hex);
+    }
+}
+
+void checkParse(const std::string& in)
+{
+    auto tc = TraceContext::parse(in, {});
+
+    if (!same(tc, sdkParse(in, {}))) {
+        fail("parse", in);
+    }
+
+    char a[TraceContext::Size];
+    char b[TraceContext::Size];
+
+    TraceContext::serialize(tc, a);
+    sdkSerialize(tc, b);
+
+    if (std::string(a, sizeof(a)) != std::string(b, sizeof(b))) {
+        fail("serialize", in);
+    }
+}
+
+// Both paths must agree before they are timed. Hex coding is checked for
+// every size up to MaxSize, i.e. SSE2 blocks with any scalar tail, on
+// random bytes and on every byte value in every digit position. So is
+// traceparent parsing, on 'headers' and on every byte value in every
+// position of a valid one.
+void check(const std::vector<std::string>& headers)
+{
+    std::minstd_rand rng;
+
+    for (size_t size = 0; size <= MaxSize; size++) {
+        std::vector<uint8_t> bytes(size);
+        char out[MaxSize * 2];
+
+        for (int i = 0; i < 1000; i++) {
+            for (auto& b : bytes) {
+                b = i == 0 ? 0 : i == 1 ? 0xff : rng();
+            }
+
+            checkEncode(bytes);
+
+            encodeHex(bytes.data(), size, out);
+            std::string hex(out, size * 2);
+
+            // some all uppercase, some of mixed case
+            for (auto& c : hex) {
+                if (i % 4 == 2 || (i % 4 == 3 && rng() % 2)) {
+                    c = std::toupper(c);
+                }
+            }
+
+            checkDecode(hex);
+        }
+
+        std::string hex;
+        for (size_t i = 0; i < size * 2; i++) {
+            hex += "0123456789abcdefABCDEF"[i % 22];
+        }
+
+        for (auto& c : hex) {
+            auto digit = c;
+
+            for (int v = 0; v < 256; v++) {
+                c = (char)v;
+                checkDecode(hex);
+            }
+
+            c = digit;
+        }
+    }
+
+    for (auto& in : headers) {
+        checkParse(in);
+    }
+
+    std::vector<std::string> valid = {headers[0],
+        "00-00000000000000000000000000000000-0000000000000000-00",
+        "00-ffffffffffffffffffffffffffffffff-ffffffffffffffff-ff",
+        "00-FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF-FFFFFFFFFFFFFFFF-FF"};
+
+    for (auto& header : valid) {
+        for (auto& c : header) {
+            auto saved = c;
+
+            for (int v = 0; v < 256; v++) {
+                c = (char)v;
+                checkParse(header);
+            }
+
+            c = saved;
+        }
+    }
+}
+
+void runHex()
+{
+    static const size_t Count = 1000000;
+
+    auto inputs = headers();
+
+    check(inputs);
+
+    size_t n = 0;
+
+    auto time = bench::measure(Count, [&]() {
+        bench::keep(TraceContext::parse(inputs[n++ % inputs.size()], {}));
+    });
+
+    bench::report("hex parse", time, "ns/header");
+
+    time = bench::measure(Count, [&]() {
+        bench::keep(sdkParse(inputs[n++ % inputs.size()], {}));
+    });
+
+    bench::report("hex parse sdk", time, "ns/header");
+
+    auto tc = TraceContext::generate(true);
+    char out[TraceContext::Size];
+
+    time = bench::measure(Count, [&]() {
+        TraceContext::serialize(tc, out);
+        bench::keep(out);
+    });
+
+    bench::report("hex serialize", time, "ns/header");
+
+    time = bench::measure(Count, [&]() {
+        sdkSerialize(tc, out);
+        bench::keep(out);
+    });
+
+    bench::report("hex serialize sdk", time, "ns/header");
+
+    uint8_t id[16];
+
+    time = bench::measure(Count, [&]() {
+        bench::keep(decodeHex(inputs[n++ % inputs.size()].data() + 3, id,
+            sizeof(id)));
+    });
+
+    bench::report("hex decode 16 bytes", time, "ns");
+
+    time = bench::measure(Count, [&]() {
+        bench::keep(detail::HexToBinary(
+            StrView(inputs[n++ % inputs.size()].data() + 3, 32), id,
+            sizeof(id)));
+    });
+
+    bench::report("hex decode 16 bytes sdk", time, "ns");
+
+    time = bench::measure(Count, [&]() {
+        encodeHex(tc.traceId.Id().data(), 16, out);
+        bench::keep(out);
+    });
+
+    bench::report("hex encode 16 bytes", time, "ns");
+
+    time = bench::measure(Count, [&]() {
+        tc.traceId.ToLowerBase16({out, kTraceIdSize});
+        bench::keep(out);
+    });
+
+    bench::report("hex encode 16 bytes sdk", time, "ns");
+}
+
+bench::Register hex("hex", runHex);
+
+}
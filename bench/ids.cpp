@@ -0,0 +1,49 @@
+#include <opentelemetry/sdk/trace/random_id_generator.h>
+
+#include "bench.hpp"
+#include "trace_context.hpp"
+
+namespace {
+
+// a trace and span ID pair, as for a request without parent context
+void runIds()
+{
+    using namespace opentelemetry::trace;
+
+    static const size_t Count = 1000000;
+
+    auto sdk = bench::measure(Count, []() {
+        // what TraceContext::generate did before IdGenerator
+        opentelemetry::sdk::trace::RandomIdGenerator idGen;
+
+        bench::keep(idGen.GenerateTraceId());
+        bench::keep(idGen.GenerateSpanId());
+    });
+
+    bench::report("ids sdk", sdk, "ns/pair");
+
+    IdGenerator::seed();
+
+    auto own = bench::measure(Count, []() {
+        uint8_t traceId[TraceId::kSize];
+        uint8_t spanId[SpanId::kSize];
+
+        IdGenerator::generate(traceId);
+        IdGenerator::generate(spanId);
+
+        bench::keep(traceId);
+        bench::keep(spanId);
+    });
+
+    bench::report("ids own", own, "ns/pair");
+
+    auto context = bench::measure(Count, []() {
+        bench::keep(TraceContext::generate(true));
+    });
+
+    bench::report("ids TraceContext::generate", context, "ns/pair");
+}
+
+bench::Register ids("ids", runIds);
+
+}
@@ -0,0 +1,57 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "bench.hpp"
+
+namespace {
+
+std::atomic<size_t> gAllocations{0};
+
+}
+
+void* operator new(size_t size)
+{
+    gAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+size_t bench::allocations()
+{
+    return gAllocations.load(std::memory_order_relaxed);
+}
+
+// runs benchmarks with names starting with any of arguments, or all of them
+int main(int argc, char** argv)
+{
+    for (auto& b : bench::registry()) {
+        bool run = argc == 1;
+
+        for (int i = 1; i < argc; i++) {
+            auto prefix = argv[i];
+            run = run || b.first.compare(0, std::strlen(prefix), prefix) == 0;
+        }
+
+        if (run) {
+            b.second();
+        }
+    }
+
+    return 0;
+}
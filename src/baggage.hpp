@@ -0,0 +1,91 @@
+#pragma once
+
+#include "str_view.hpp"
+
+// Looks up W3C Baggage entries right in the header value, so nothing is
+// parsed or copied until an entry is read.
+class Baggage {
+public:
+    explicit Baggage(StrView header) : header(header) {}
+
+    // Finds value of the first entry with key equal to 'name' ignoring case,
+    // where '_' also matches '-', as variable names can't have the latter.
+    // Properties are stripped, but value is still percent-encoded.
+    bool find(StrView name, StrView& value) const
+    {
+        auto list = header;
+
+        while (!list.empty()) {
+            auto end = list.find(',');
+            auto member = list.substr(0, end);
+
+            list = end == StrView::npos ? StrView() : list.substr(end + 1);
+
+            auto eq = member.find('=');
+            if (eq == StrView::npos) {
+                continue;
+            }
+
+            if (!keyMatches(trim(member.substr(0, eq)), name)) {
+                continue;
+            }
+
+            auto rest = member.substr(eq + 1);
+            value = trim(rest.substr(0, rest.find(';')));
+
+            return true;
+        }
+
+        return false;
+    }
+
+private:
+    static bool isBlank(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    static StrView trim(StrView str)
+    {
+        size_t first = 0;
+        size_t last = str.size();
+
+        while (first < last && isBlank(str.data()[first])) {
+            first++;
+        }
+
+        while (last > first && isBlank(str.data()[last - 1])) {
+            last--;
+        }
+
+        return str.substr(first, last - first);
+    }
+
+    static bool keyMatches(StrView key, StrView name)
+    {
+        if (key.size() != name.size()) {
+            return false;
+        }
+
+        for (size_t i = 0; i < key.size(); i++) {
+            char k = key.data()[i];
+            char n = name.data()[i];
+
+            if (k >= 'A' && k <= 'Z') {
+                k |= 0x20;
+            }
+
+            if (n >= 'A' && n <= 'Z') {
+                n |= 0x20;
+            }
+
+            if (k != n && !(k == '-' && n == '_')) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    StrView header;
+};
@@ -2,25 +2,56 @@
 
 #include <nginx.h>
 
-#include <thread>
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
 #include <vector>
 
 #include "str_view.hpp"
+#include "proto_reader.hpp"
+#include "proto_writer.hpp"
+#include "spill_queue.hpp"
 #include "trace_context.hpp"
-#include "trace_service_client.hpp"
+#include "export_client.hpp"
 
+// Spans are recorded as fixed-layout records with all strings copied into
+// a per-batch slab. They are encoded in OTLP wire format on the exporter
+// thread, which keeps this work off the worker event loop. Log records are
+// batched the same way by another instance, as ExportLogsServiceRequest has
+// the same layout down to ScopeLogs.log_records.
 class BatchExporter {
 public:
-    typedef TraceServiceClient::Request Request;
-    typedef TraceServiceClient::Response Response;
-
     struct SpanInfo {
         StrView name;
         TraceContext trace;
         opentelemetry::trace::SpanId parent;
         uint64_t start;
         uint64_t end;
+
+        // kept over other spans if buffers are short
+        bool priority;
+
+        // CLIENT span, SERVER otherwise
+        bool client;
+    };
+
+    struct Record {
+        uint8_t traceId[16];
+        uint8_t spanId[8];
+        uint8_t parentId[8];
+        uint64_t start;
+        uint64_t end;
+
+        // name, trace state and attributes in slab, or severity text and
+        // body for log records
+        uint32_t offset;
+        uint32_t size;
+        uint32_t nameLen;
+        uint32_t stateLen;
+
+        uint32_t flags;
     };
 
     class Span {
@@ -28,206 +59,962 @@ public:
         Span(const Span&) = delete;
         Span& operator=(const Span&) = delete;
 
-        Span(const SpanInfo& info, opentelemetry::proto::trace::v1::Span* span)
-            : span(span)
+        Span(Record& rec, std::string& slab) : rec(rec), slab(slab) {}
+
+        void add(StrView key, StrView value)
         {
-            span->set_kind(
-                opentelemetry::proto::trace::v1::Span::SPAN_KIND_SERVER);
+            addAttr(AttrString, key, value);
+        }
 
-            // Short setters, like set_name(), use additional std::string as an
-            // intermediary at least up to v21.5 of protobuf.
-            set(span->mutable_name(), info.name);
+        void add(StrView key, int64_t value)
+        {
+            addAttr(AttrInt, key, StrView((char*)&value, sizeof(value)));
+        }
 
-            set(span->mutable_trace_id(), info.trace.traceId.Id());
-            set(span->mutable_span_id(), info.trace.spanId.Id());
-            set(span->mutable_trace_state(), info.trace.state);
+        void addDouble(StrView key, double value)
+        {
+            addAttr(AttrDouble, key,
+                StrView((char*)&value, sizeof(value)));
+        }
 
-            if (info.parent.IsValid()) {
-                set(span->mutable_parent_span_id(), info.parent.Id());
-            } else {
-                span->mutable_parent_span_id()->clear();
-            }
+        void addArray(StrView key, StrView value)
+        {
+            addAttr(AttrArray, key, value);
+        }
 
-            span->set_start_time_unix_nano(info.start);
-            span->set_end_time_unix_nano(info.end);
+        // attributes from EncodedAttrs
+        void addEncoded(StrView attrs)
+        {
+            addAttr(AttrEncoded, StrView(), attrs);
+        }
+
+        // 'time' is in nanoseconds since epoch
+        void addEvent(StrView name, uint64_t time)
+        {
+            addAttr(AttrEvent, name, StrView((char*)&time, sizeof(time)));
+        }
 
-            span->mutable_status()->clear_code();
+        void setError()
+        {
+            rec.flags |= RecordError;
         }
 
-        ~Span()
+    private:
+        void addAttr(uint8_t type, StrView key, StrView value)
         {
-            truncate(span->mutable_attributes(), attrSize);
+            AttrHeader header{type, (uint32_t)key.size(),
+                (uint32_t)value.size()};
+
+            slab.append((char*)&header, sizeof(header));
+            slab.append(key.data(), key.size());
+            slab.append(value.data(), value.size());
         }
 
+        Record& rec;
+        std::string& slab;
+    };
+
+    // Attributes encoded in advance, for those constant over many spans.
+    class EncodedAttrs {
+    public:
         void add(StrView key, StrView value)
         {
-            add(key)->mutable_value()->mutable_string_value()->assign(
-                value.data(), value.size());
+            ProtoWriter out(buf);
+            encodeAttr(out, AttrString, key, value);
         }
 
-        void add(StrView key, int value)
+        void add(StrView key, int64_t value)
         {
-            add(key)->mutable_value()->set_int_value(value);
+            ProtoWriter out(buf);
+            encodeAttr(out, AttrInt, key,
+                StrView((char*)&value, sizeof(value)));
         }
 
         void addArray(StrView key, StrView value)
         {
-            auto elems = add(key)->mutable_value()->mutable_array_value()->
-                mutable_values();
-
-            auto elem = elems->size() > 0 ? elems->Mutable(0) : elems->Add();
-
-            elem->mutable_string_value()->assign(value.data(), value.size());
+            ProtoWriter out(buf);
+            encodeAttr(out, AttrArray, key, value);
         }
 
-        void setError()
+        StrView data() const
         {
-            span->mutable_status()->set_code(
-                opentelemetry::proto::trace::v1::Status::STATUS_CODE_ERROR);
+            return buf;
         }
 
     private:
-        template <class ByteRange>
-        static void set(std::string* str, const ByteRange& range)
-        {
-            str->assign((const char*)range.data(), range.size());
+        std::string buf;
+    };
+
+    BatchExporter(std::unique_ptr<ExportClient> client,
+            size_t batchSize, size_t batchCount,
+            const std::map<StrView, StrView>& resourceAttrs,
+            std::unique_ptr<SpillQueue> spill = nullptr,
+            Signal signal = Signal::Traces) :
+        maxBatchSize(batchSize), batchSize(batchSize), signal(signal),
+        batches(batchCount), rng(std::random_device{}()),
+        spill(std::move(spill)), client(std::move(client))
+    {
+        ProtoWriter out(prefix);
+
+        // ExportTraceServiceRequest.resource_spans
+        resourceSpansPos = out.begin(1);
+
+        // ResourceSpans.resource
+        auto resourcePos = out.begin(1);
+        for (auto& attr : resourceAttrs) {
+            // Resource.attributes
+            auto attrPos = out.begin(1);
+            out.bytes(1, attr.first);
+            out.header(2, ProtoWriter::fieldSize(attr.second.size()));
+            out.bytes(1, attr.second);
+            out.end(attrPos);
         }
+        out.end(resourcePos);
+
+        // ResourceSpans.scope_spans
+        scopeSpansPos = out.begin(2);
+
+        // ScopeSpans.scope
+        auto scopePos = out.begin(1);
+        out.bytes(1, StrView("nginx"));
+        out.bytes(2, StrView(NGINX_VERSION));
+        out.end(scopePos);
+
+        for (auto& batch : batches) {
+            batch.records.reserve(batchSize);
+            batch.slab.reserve(batchSize * EstimatedSpanSize);
+            batch.data.reserve(prefix.size() + batchSize * EstimatedSpanSize);
+            batch.next = free;
+            free = &batch;
+        }
+    }
 
-        opentelemetry::proto::common::v1::KeyValue* add(StrView key)
-        {
-            auto attrs = span->mutable_attributes();
+    ~BatchExporter()
+    {
+        stopping = true;
+        client.reset();
+    }
+
+    template <class F>
+    bool add(const SpanInfo& info, F fillSpan)
+    {
+        if (!prepareBatch(info.priority)) {
+            return false;
+        }
+
+        auto& slab = current->slab;
+        size_t size = slab.size();
 
-            auto newAttr = attrs->size() > attrSize ?
-                attrs->Mutable(attrSize) : attrs->Add();
+        try {
+            current->records.push_back(
+                writeSpan(slab, info, fillSpan));
+        } catch (...) {
+            slab.resize(size);
+            throw;
+        }
 
-            newAttr->mutable_key()->assign(key.data(), key.size());
+        spans++;
+
+        return true;
+    }
 
-            ++attrSize;
+    // adds span recorded by encode(), e.g. in another process
+    bool addEncoded(StrView data)
+    {
+        Record rec;
+        std::memcpy(&rec, data.data(), sizeof(rec));
 
-            return newAttr;
+        if (!prepareBatch(rec.flags & RecordPriority)) {
+            return false;
         }
 
-        opentelemetry::proto::trace::v1::Span* span;
-        int attrSize{0};
-    };
+        rec.offset = current->slab.size();
+        current->slab.append(data.data() + sizeof(rec), rec.size);
 
-    BatchExporter(const Target& target,
-            size_t batchSize, size_t batchCount,
-            const std::map<StrView, StrView>& resourceAttrs) :
-        batchSize(batchSize), client(target)
-    {
-        free.reserve(batchCount);
-        while (batchCount-- > 0) {
-            free.emplace_back();
-            auto resourceSpans = free.back().add_resource_spans();
-
-            for (auto& attr : resourceAttrs) {
-                auto kv = resourceSpans->mutable_resource()->add_attributes();
-                kv->set_key(std::string(attr.first));
-                kv->mutable_value()->set_string_value(std::string(attr.second));
-            }
+        current->records.push_back(rec);
 
-            auto scopeSpans = resourceSpans->add_scope_spans();
-            scopeSpans->mutable_scope()->set_name("nginx");
-            scopeSpans->mutable_scope()->set_version(NGINX_VERSION);
+        spans++;
 
-            scopeSpans->mutable_spans()->Reserve(batchSize);
+        return true;
+    }
+
+    // 'time' is in nanoseconds since epoch, 'severity' is OTLP SeverityNumber
+    bool addLog(const TraceContext& trace, uint64_t time, uint32_t severity,
+        StrView severityText, StrView body)
+    {
+        if (!prepareBatch(false)) {
+            return false;
         }
 
-        worker = std::thread(&TraceServiceClient::run, &client);
+        auto& slab = current->slab;
+
+        Record rec;
+
+        copyId(rec.traceId, trace.traceId.Id());
+        copyId(rec.spanId, trace.spanId.Id());
+        std::memset(rec.parentId, 0, sizeof(rec.parentId));
+
+        rec.start = time;
+        rec.end = time;
+
+        rec.offset = slab.size();
+        rec.size = severityText.size() + body.size();
+        rec.nameLen = severityText.size();
+        rec.stateLen = 0;
+        rec.flags = RecordLog | severity << SeverityShift |
+            (trace.sampled ? RecordSampled : 0);
+
+        slab.append(severityText.data(), severityText.size());
+        slab.append(body.data(), body.size());
+
+        current->records.push_back(rec);
+
+        spans++;
+
+        return true;
     }
 
-    ~BatchExporter()
+    // records span into position-independent buffer
+    template <class F>
+    static StrView encode(const SpanInfo& info, F fillSpan)
+    {
+        static std::string buf;
+
+        buf.assign(sizeof(Record), '\0');
+
+        auto rec = writeSpan(buf, info, fillSpan);
+        std::memcpy(&buf[0], &rec, sizeof(rec));
+
+        return buf;
+    }
+
+    void flush()
     {
-        client.stop();
-        worker.join();
+        replaySpilled();
+
+        if (current == NULL || current->records.empty()) {
+            return;
+        }
+
+        sendBatch(current);
+        current = NULL;
     }
 
+    // up to the size set in constructor, applies to the next batch
+    void setBatchSize(size_t size)
+    {
+        batchSize = std::min(std::max(size, (size_t)1), maxBatchSize);
+    }
+
+    // spans at the end of the last free buffer kept for priority spans
+    void setPriorityReserve(size_t spans)
+    {
+        priorityReserve = std::min(spans, maxBatchSize - 1);
+    }
+
+    uint64_t spanCount() const
+    {
+        return spans;
+    }
+
+    size_t batchCount() const
+    {
+        return batches.size();
+    }
+
+    // batches sent and not yet returned, including retried ones
+    size_t inFlight() const
+    {
+        return sentBatches - doneBatches.load(std::memory_order_relaxed);
+    }
+
+    // average time from sending batch to response, in milliseconds
+    ngx_msec_t exportTime() const
+    {
+        return avgExportTime.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct AttrHeader {
+        uint8_t type;
+        uint32_t keyLen;
+        uint32_t valueLen;
+    };
+
+    struct Batch {
+        std::vector<Record> records;
+        std::string slab;
+
+        // ExportTraceServiceRequest, filled on exporter thread
+        std::string data;
+        size_t attempts;
+        std::chrono::steady_clock::time_point sentAt;
+
+        Batch* next;
+    };
+
+    static const uint8_t AttrString = 0;
+    static const uint8_t AttrInt = 1;
+    static const uint8_t AttrArray = 2;
+    static const uint8_t AttrDouble = 3;
+    static const uint8_t AttrEncoded = 4;
+    static const uint8_t AttrEvent = 5;
+
+    static const uint32_t RecordError = 1;
+    static const uint32_t RecordPriority = 2;
+    static const uint32_t RecordClient = 4;
+    static const uint32_t RecordLog = 8;
+    static const uint32_t RecordSampled = 16;
+
+    // of log record severity in flags
+    static const uint32_t SeverityShift = 8;
+
+    static const uint64_t SpanKindServer = 2;
+    static const uint64_t SpanKindClient = 3;
+    static const uint64_t StatusCodeError = 2;
+
+    static const size_t EstimatedSpanSize = 512;
+
+    // after the first attempt
+    static const size_t MaxRetries = 5;
+
+    // in milliseconds
+    static const int64_t InitialBackoff = 1000;
+    static const int64_t MaxBackoff = 5000;
+    static const int64_t MaxRetryDelay = 30000;
+    static const int64_t NoRetry = -1;
+
+    const size_t maxBatchSize;
+    size_t batchSize;
+    size_t priorityReserve{0};
+
+    // traces or logs
+    const Signal signal;
+
+    std::string prefix;
+    size_t resourceSpansPos;
+    size_t scopeSpansPos;
+
+    std::vector<Batch> batches;
+
+    // Owned by the adding thread. Batches returned by exporter thread are
+    // taken all at once, so the list has single consumer and can't hit ABA.
+    Batch* free{NULL};
+    std::atomic<Batch*> returned{NULL};
+
+    Batch* current{NULL};
+
+    // load stats, updated on adding and exporter threads respectively
+    uint64_t spans{0};
+    size_t sentBatches{0};
+    std::atomic<size_t> doneBatches{0};
+    std::atomic<ngx_msec_t> avgExportTime{0};
+
+    // Owned by the response callback. At least one batch is never held
+    // for retry, so new spans are not dropped while the collector is down.
+    // The only batch is still retried once.
+    size_t retrying{0};
+    std::minstd_rand rng;
+    std::atomic<bool> stopping{false};
+
+    // batches failed after retries, replayed on flush
+    std::unique_ptr<SpillQueue> spill;
+    std::atomic<bool> replaying{false};
+    std::atomic<bool> healthy{true};
+
+    std::atomic<size_t> rejectedRecords{0};
+
+    // destroyed first, as in-flight requests refer to batches
+    std::unique_ptr<ExportClient> client;
+
     template <class F>
-    bool add(const SpanInfo& info, F fillSpan)
+    static Record writeSpan(std::string& slab, const SpanInfo& info,
+        F fillSpan)
     {
-        if (currentSize == (int)batchSize) {
-            sendBatch(current);
-            currentSize = -1;
+        Record rec;
+
+        copyId(rec.traceId, info.trace.traceId.Id());
+        copyId(rec.spanId, info.trace.spanId.Id());
+
+        if (info.parent.IsValid()) {
+            copyId(rec.parentId, info.parent.Id());
+        } else {
+            std::memset(rec.parentId, 0, sizeof(rec.parentId));
         }
 
-        if (currentSize == -1) {
-            std::unique_lock<std::mutex> lock(mutex);
-            if (free.empty()) {
+        rec.start = info.start;
+        rec.end = info.end;
+
+        rec.offset = slab.size();
+        rec.nameLen = info.name.size();
+        rec.stateLen = info.trace.state.size();
+        rec.flags = (info.priority ? RecordPriority : 0) |
+            (info.client ? RecordClient : 0) |
+            (info.trace.sampled ? RecordSampled : 0);
+
+        slab.append(info.name.data(), info.name.size());
+        slab.append(info.trace.state.data(), info.trace.state.size());
+
+        Span span(rec, slab);
+        fillSpan(span);
+
+        rec.size = slab.size() - rec.offset;
+
+        return rec;
+    }
+
+    template <size_t N, class Id>
+    static void copyId(uint8_t (&dst)[N], const Id& id)
+    {
+        std::memcpy(dst, id.data(), N);
+    }
+
+    bool hasFreeBatch() const
+    {
+        return free || returned.load(std::memory_order_relaxed);
+    }
+
+    bool prepareBatch(bool priority)
+    {
+        if (current) {
+            size_t size = current->records.size();
+            bool last = !hasFreeBatch();
+
+            // rather than drop spans, the last buffer fills up to its capacity
+            size_t limit = last ? maxBatchSize : batchSize;
+
+            if (size >= limit) {
+                // there's no buffer for the next batch, so priority span
+                // takes place of an ordinary one
+                if (last && priority && evictSpan()) {
+                    return true;
+                }
+
+                sendBatch(current);
+                current = NULL;
+
+            } else if (last && !priority && size + priorityReserve >= limit) {
+                // tail of the last buffer is kept for priority spans
                 return false;
             }
-            current = std::move(free.back());
-            free.pop_back();
-            currentSize = 0;
         }
 
-        auto spans = getSpans(current);
+        if (current == NULL) {
+            if (free == NULL) {
+                free = returned.exchange(NULL, std::memory_order_acquire);
+                if (free == NULL) {
+                    return false;
+                }
+            }
 
-        Span span(info, spans->size() > currentSize ?
-            spans->Mutable(currentSize) : spans->Add());
+            current = free;
+            free = free->next;
 
-        fillSpan(span);
-
-        ++currentSize;
+            current->records.clear();
+            current->slab.clear();
+            current->attempts = 0;
+        }
 
         return true;
     }
 
-    void flush()
+    // drops the latest ordinary span with its slab space
+    bool evictSpan()
     {
-        if (currentSize <= 0) {
-            return;
+        auto& records = current->records;
+
+        for (auto it = records.end(); it != records.begin(); ) {
+            --it;
+
+            if (it->flags & RecordPriority) {
+                continue;
+            }
+
+            auto offset = it->offset;
+            auto size = it->size;
+
+            current->slab.erase(offset, size);
+            records.erase(it);
+
+            for (auto& rec : records) {
+                if (rec.offset > offset) {
+                    rec.offset -= size;
+                }
+            }
+
+            return true;
         }
 
-        truncate(getSpans(current), currentSize);
+        return false;
+    }
 
-        sendBatch(current);
-        currentSize = -1;
+    // runs on exporter thread
+    static void encodeSpan(ProtoWriter& out, const Record& rec,
+        const char* data)
+    {
+        // ScopeSpans.spans
+        auto pos = out.begin(2);
+
+        out.bytes(1, StrView((char*)rec.traceId, sizeof(rec.traceId)));
+        out.bytes(2, StrView((char*)rec.spanId, sizeof(rec.spanId)));
+
+        if (rec.stateLen) {
+            out.bytes(3, StrView(data + rec.nameLen, rec.stateLen));
+        }
+
+        static const uint8_t noParent[sizeof(rec.parentId)] = {};
+        if (std::memcmp(rec.parentId, noParent, sizeof(noParent)) != 0) {
+            out.bytes(4, StrView((char*)rec.parentId, sizeof(rec.parentId)));
+        }
+
+        out.bytes(5, StrView(data, rec.nameLen));    // name
+
+        if (rec.flags & RecordClient) {
+            out.varint(6, SpanKindClient);           // kind
+        } else {
+            out.varint(6, SpanKindServer);
+        }
+
+        out.fixed64(7, rec.start);                   // start_time_unix_nano
+        out.fixed64(8, rec.end);                     // end_time_unix_nano
+
+        auto p = data + rec.nameLen + rec.stateLen;
+        auto last = data + rec.size;
+
+        while (p < last) {
+            AttrHeader header;
+            std::memcpy(&header, p, sizeof(header));
+            p += sizeof(header);
+
+            StrView key(p, header.keyLen);
+            p += header.keyLen;
+
+            StrView value(p, header.valueLen);
+            p += header.valueLen;
+
+            if (header.type == AttrEvent) {
+                encodeEvent(out, key, value);
+            } else {
+                encodeAttr(out, header.type, key, value);
+            }
+        }
+
+        if (rec.flags & RecordError) {
+            // Span.status with code
+            out.header(15, 2);
+            out.varint(3, StatusCodeError);
+        }
+
+        if (rec.flags & RecordSampled) {
+            out.fixed32(16, 1);                      // flags
+        }
+
+        out.end(pos);
     }
 
-private:
-    const size_t batchSize;
+    // runs on exporter thread
+    static void encodeLog(ProtoWriter& out, const Record& rec,
+        const char* data)
+    {
+        StrView body(data + rec.nameLen, rec.size - rec.nameLen);
+
+        // ScopeLogs.log_records
+        auto pos = out.begin(2);
 
-    TraceServiceClient client;
+        out.fixed64(1, rec.start);                   // time_unix_nano
+        out.varint(2, rec.flags >> SeverityShift);   // severity_number
+        out.bytes(3, StrView(data, rec.nameLen));    // severity_text
 
-    std::mutex mutex;
-    std::vector<Request> free;
+        // body
+        out.header(5, ProtoWriter::fieldSize(body.size()));
+        out.bytes(1, body);                          // string_value
+
+        if (rec.flags & RecordSampled) {
+            out.fixed32(8, 1);                       // flags
+        }
 
-    Request current;
-    int currentSize{-1};
+        out.bytes(9, StrView((char*)rec.traceId, sizeof(rec.traceId)));
+        out.bytes(10, StrView((char*)rec.spanId, sizeof(rec.spanId)));
+        out.fixed64(11, rec.end);                    // observed_time_unix_nano
 
-    std::thread worker;
+        out.end(pos);
+    }
 
-    static auto getSpans(Request& req) -> decltype(
-        req.mutable_resource_spans(0)->mutable_scope_spans(0)->mutable_spans())
+    static void encodeEvent(ProtoWriter& out, StrView name, StrView time)
     {
-        return req.mutable_resource_spans(0)->mutable_scope_spans(0)->
-            mutable_spans();
+        uint64_t timeNs;
+        std::memcpy(&timeNs, time.data(), sizeof(timeNs));
+
+        // Span.events
+        out.header(11, 1 + sizeof(timeNs) +
+            ProtoWriter::fieldSize(name.size()));
+
+        out.fixed64(1, timeNs);                      // time_unix_nano
+        out.bytes(2, name);                          // name
     }
 
-    template <class T>
-    static void truncate(T* items, int newSize)
+    static void encodeAttr(ProtoWriter& out, uint8_t type, StrView key,
+        StrView value)
     {
-        // unlike DeleteSubrange(), this doesn't destruct removed items
-        int tailSize = items->size() - newSize;
-        while (tailSize-- > 0) {
-            items->RemoveLast();
+        if (type == AttrEncoded) {
+            out.raw(value);
+            return;
+        }
+
+        size_t valueSize;
+        size_t elemSize = 0;
+        size_t arraySize = 0;
+        uint64_t intValue = 0;
+
+        if (type == AttrInt) {
+            int64_t v;
+            std::memcpy(&v, value.data(), sizeof(v));
+            intValue = v;
+            valueSize = 1 + ProtoWriter::varintSize(intValue);
+
+        } else if (type == AttrDouble) {
+            std::memcpy(&intValue, value.data(), sizeof(intValue));
+            valueSize = 1 + sizeof(intValue);
+
+        } else if (type == AttrArray) {
+            elemSize = ProtoWriter::fieldSize(value.size());
+            arraySize = ProtoWriter::fieldSize(elemSize);
+            valueSize = ProtoWriter::fieldSize(arraySize);
+
+        } else {
+            valueSize = ProtoWriter::fieldSize(value.size());
+        }
+
+        // Span.attributes
+        out.header(9, ProtoWriter::fieldSize(key.size()) +
+            ProtoWriter::fieldSize(valueSize));
+
+        out.bytes(1, key);                           // key
+        out.header(2, valueSize);                    // value
+
+        if (type == AttrInt) {
+            out.varint(3, intValue);                 // int_value
+
+        } else if (type == AttrDouble) {
+            out.fixed64(4, intValue);                // double_value
+
+        } else if (type == AttrArray) {
+            out.header(5, arraySize);                // array_value
+            out.header(1, elemSize);
+            out.bytes(1, value);
+
+        } else {
+            out.bytes(1, value);                     // string_value
         }
     }
 
-    void sendBatch(Request& request)
+    StrView encodeBatch(Batch* batch)
     {
-        client.send(request,
-            [this](Request req, Response, grpc::Status status) {
-                std::unique_lock<std::mutex> lock(mutex);
-                free.push_back(std::move(req));
-                lock.unlock();
+        // already encoded for previous attempt
+        if (batch->attempts > 0) {
+            return batch->data;
+        }
+
+        try {
+            batch->data.assign(prefix);
+
+            ProtoWriter out(batch->data);
 
-                if (!status.ok()) {
-                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                        "OTel export failure: %s",
-                        status.error_message().c_str());
+            for (auto& rec : batch->records) {
+                auto data = batch->slab.data() + rec.offset;
+
+                if (rec.flags & RecordLog) {
+                    encodeLog(out, rec, data);
+                } else {
+                    encodeSpan(out, rec, data);
                 }
+            }
+
+            out.end(scopeSpansPos);
+            out.end(resourceSpansPos);
+
+        } catch (const std::exception& e) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "OTel failed to encode batch: %s", e.what());
+
+            // empty request is still valid
+            batch->data.clear();
+        }
+
+        return batch->data;
+    }
+
+    // Sends the oldest spilled request, at most one at a time and only
+    // after the last export succeeded.
+    void replaySpilled()
+    {
+        if (!spill || replaying || !healthy) {
+            return;
+        }
+
+        auto data = spill->front();
+        if (data.empty()) {
+            return;
+        }
+
+        replaying = true;
+
+        client->send(
+            [data]() {
+                return data;
+            },
+            [this](grpc::ByteBuffer response, grpc::Status status) {
+                return std::chrono::milliseconds(
+                    onReplayResponse(response, status));
             });
     }
+
+    // runs on exporter thread
+    int64_t onReplayResponse(grpc::ByteBuffer& response,
+        const grpc::Status& status)
+    {
+        healthy = status.ok();
+
+        if (status.ok()) {
+            checkPartialSuccess(response);
+            spill->pop();
+
+        } else if (!retryable(status)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "OTel export failure: %s, spilled batch is dropped",
+                status.error_message().c_str());
+            spill->pop();
+        }
+
+        replaying = false;
+
+        return NoRetry;
+    }
+
+    void sendBatch(Batch* batch)
+    {
+        batch->sentAt = std::chrono::steady_clock::now();
+        sentBatches++;
+
+        client->send(
+            [this, batch]() {
+                return encodeBatch(batch);
+            },
+            [this, batch](grpc::ByteBuffer response, grpc::Status status) {
+                return std::chrono::milliseconds(
+                    onResponse(batch, response, status));
+            });
+    }
+
+    // runs on exporter thread, returns delay to retry batch after
+    int64_t onResponse(Batch* batch,
+        grpc::ByteBuffer& response, const grpc::Status& status)
+    {
+        if (batch->attempts > 0) {
+            retrying--;
+        } else {
+            updateExportTime(batch);
+        }
+
+        batch->attempts++;
+
+        healthy = status.ok();
+
+        if (status.ok()) {
+            checkPartialSuccess(response);
+
+        } else {
+            auto delay = retryDelay(batch, status);
+
+            if (delay != NoRetry && delay <= MaxRetryDelay && !stopping &&
+                batch->attempts <= MaxRetries &&
+                (retrying + 1 < batches.size() ||
+                    (batches.size() == 1 && batch->attempts == 1)))
+            {
+                retrying++;
+
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                    "OTel export failure: %s, retrying in %Mms",
+                    status.error_message().c_str(),
+                    (ngx_msec_t)delay);
+
+                return delay;
+            }
+
+            if (delay != NoRetry && spill && !batch->data.empty() &&
+                spill->push(batch->data))
+            {
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                    "OTel export failure: %s, batch is spilled",
+                    status.error_message().c_str());
+
+            } else {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "OTel export failure: %s",
+                    status.error_message().c_str());
+            }
+        }
+
+        auto head = returned.load(std::memory_order_relaxed);
+        do {
+            batch->next = head;
+        } while (!returned.compare_exchange_weak(head, batch,
+            std::memory_order_release, std::memory_order_relaxed));
+
+        doneBatches.fetch_add(1, std::memory_order_relaxed);
+
+        return NoRetry;
+    }
+
+    void updateExportTime(Batch* batch)
+    {
+        ngx_msec_t time = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - batch->sentAt).count();
+
+        // moving average over about 4 last batches
+        auto avg = avgExportTime.load(std::memory_order_relaxed);
+        avg = avg ? avg - avg / 4 + time / 4 : time;
+        avgExportTime.store(avg, std::memory_order_relaxed);
+    }
+
+    static bool retryable(const grpc::Status& status)
+    {
+        switch (status.error_code()) {
+        case grpc::StatusCode::CANCELLED:
+        case grpc::StatusCode::DEADLINE_EXCEEDED:
+        case grpc::StatusCode::ABORTED:
+        case grpc::StatusCode::OUT_OF_RANGE:
+        case grpc::StatusCode::UNAVAILABLE:
+        case grpc::StatusCode::DATA_LOSS:
+            return true;
+
+        // only if server says when
+        case grpc::StatusCode::RESOURCE_EXHAUSTED:
+            return retryInfoDelay(status.error_details()) != NoRetry;
+
+        default:
+            return false;
+        }
+    }
+
+    // returns NoRetry if failure is permanent
+    int64_t retryDelay(Batch* batch, const grpc::Status& status)
+    {
+        if (!retryable(status)) {
+            return NoRetry;
+        }
+
+        auto hint = retryInfoDelay(status.error_details());
+        if (hint != NoRetry) {
+            return hint;
+        }
+
+        // exponential backoff with jitter in [delay / 2, delay]
+        int64_t delay = InitialBackoff << (batch->attempts - 1);
+        if (delay > MaxBackoff) {
+            delay = MaxBackoff;
+        }
+
+        return delay / 2 + rng() % (delay / 2 + 1);
+    }
+
+    // finds google.rpc.RetryInfo in serialized google.rpc.Status
+    static int64_t retryInfoDelay(const std::string& details)
+    {
+        ProtoReader status(details);
+        while (status.next()) {
+            if (status.field() != 3) {           // details
+                continue;
+            }
+
+            StrView typeUrl;
+            StrView value;
+
+            ProtoReader any(status.bytes());
+            while (any.next()) {
+                if (any.field() == 1) {
+                    typeUrl = any.bytes();
+                } else if (any.field() == 2) {
+                    value = any.bytes();
+                }
+            }
+
+            if (typeUrl != "type.googleapis.com/google.rpc.RetryInfo") {
+                continue;
+            }
+
+            ProtoReader info(value);
+            while (info.next()) {
+                if (info.field() != 1) {         // retry_delay
+                    continue;
+                }
+
+                uint64_t seconds = 0;
+                uint64_t nanos = 0;
+
+                ProtoReader duration(info.bytes());
+                while (duration.next()) {
+                    if (duration.field() == 1) {
+                        seconds = duration.varint();
+                    } else if (duration.field() == 2) {
+                        nanos = duration.varint();
+                    }
+                }
+
+                // negative or absurd values are not retried
+                if (seconds > MaxRetryDelay / 1000) {
+                    return INT64_MAX;
+                }
+
+                return seconds * 1000 + nanos % 1000000000 / 1000000;
+            }
+        }
+
+        return NoRetry;
+    }
+
+    // ExportTraceServiceResponse.partial_success
+    void checkPartialSuccess(grpc::ByteBuffer& response)
+    {
+        std::vector<grpc::Slice> slices;
+        if (response.Length() == 0 || !response.Dump(&slices).ok()) {
+            return;
+        }
+
+        std::string data;
+        for (auto& slice : slices) {
+            data.append((const char*)slice.begin(), slice.size());
+        }
+
+        ProtoReader msg(data);
+        while (msg.next()) {
+            if (msg.field() != 1) {
+                continue;
+            }
+
+            uint64_t rejected = 0;
+            StrView error;
+
+            ProtoReader partial(msg.bytes());
+            while (partial.next()) {
+                if (partial.field() == 1) {
+                    rejected = partial.varint();
+                } else if (partial.field() == 2) {
+                    error = partial.bytes();
+                }
+            }
+
+            if (rejected == 0) {
+                continue;
+            }
+
+            auto total = rejectedRecords += rejected;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                "OTel export partially failed: %uL %s rejected "
+                "(%uz in total): %*s", rejected,
+                signal == Signal::Logs ? "log records" : "spans", total,
+                error.size(), error.data());
+        }
+    }
 };
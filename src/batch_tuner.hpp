@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+
+#include "batch_exporter.hpp"
+
+// Adapts batch size and flush interval of exporter to its load, within
+// bounds. Idle worker waits longer to send fuller batches, while busy one
+// sends larger batches to keep buffers free during slow exports. Expects
+// to be called every 'minInterval' to react to load changes quickly.
+class BatchTuner {
+public:
+    BatchTuner(size_t minBatchSize, size_t maxBatchSize,
+            ngx_msec_t minInterval, ngx_msec_t maxInterval) :
+        minBatchSize(minBatchSize), maxBatchSize(maxBatchSize),
+        minInterval(minInterval), maxInterval(maxInterval),
+        size(minBatchSize), delay(maxInterval) {}
+
+    // returns true if it's time to flush
+    bool update(BatchExporter& exporter, ngx_msec_t now)
+    {
+        auto spans = exporter.spanCount();
+
+        if (!started) {
+            started = true;
+            lastSpans = spans;
+            lastTime = now;
+            lastFlush = now;
+            return false;
+        }
+
+        ngx_msec_int_t elapsed = now - lastTime;
+        if (elapsed > 0) {
+            // follow load increase at once, and decrease gradually
+            double sample = (double)(spans - lastSpans) / elapsed;
+            rate = std::max(sample, rate + RateWeight * (sample - rate));
+
+            lastSpans = spans;
+            lastTime = now;
+        }
+
+        // Buffers are held for export time, so batch takes enough spans
+        // to leave half of them free at current rate.
+        double target = rate * std::max<ngx_msec_t>(exporter.exportTime(), 1)
+            * 2 / exporter.batchCount();
+
+        // grow fast if buffers run out anyway
+        if (exporter.inFlight() + 1 >= exporter.batchCount()) {
+            target = std::max(target, (double)size * 2);
+        }
+
+        size = (size_t)std::min(std::max(target, (double)minBatchSize),
+            (double)maxBatchSize);
+
+        exporter.setBatchSize(size);
+
+        // flush about when batch would be full
+        double fill = rate > 0 ? size / rate : maxInterval;
+
+        delay = (ngx_msec_t)std::min(std::max(fill, (double)minInterval),
+            (double)maxInterval);
+
+        if ((ngx_msec_int_t)(now - lastFlush) < (ngx_msec_int_t)delay) {
+            return false;
+        }
+
+        lastFlush = now;
+        return true;
+    }
+
+    size_t batchSize() const
+    {
+        return size;
+    }
+
+    // current flush interval
+    ngx_msec_t interval() const
+    {
+        return delay;
+    }
+
+    ngx_msec_t tick() const
+    {
+        return minInterval;
+    }
+
+private:
+    // of the latest rate sample
+    static constexpr double RateWeight = 0.3;
+
+    const size_t minBatchSize;
+    const size_t maxBatchSize;
+    const ngx_msec_t minInterval;
+    const ngx_msec_t maxInterval;
+
+    size_t size;
+    ngx_msec_t delay;
+
+    // spans per millisecond
+    double rate{0};
+
+    bool started{false};
+    uint64_t lastSpans{0};
+    ngx_msec_t lastTime{0};
+    ngx_msec_t lastFlush{0};
+};
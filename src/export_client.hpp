@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "str_view.hpp"
+
+struct Target {
+    typedef std::vector<std::pair<std::string, std::string>> HeaderVec;
+
+    std::string endpoint;
+    bool ssl;
+    std::string trustedCert;
+    HeaderVec headers;
+    grpc_compression_algorithm compression{GRPC_COMPRESS_NONE};
+    size_t channels{1};
+    size_t maxInFlight{SIZE_MAX};
+
+    static bool validateHeaderName(StrView name)
+    {
+        return grpc_header_key_is_legal(
+            grpc_slice_from_static_buffer(name.data(), name.size()));
+    }
+
+    static bool validateHeaderValue(StrView value)
+    {
+        return grpc_header_nonbin_value_is_legal(
+            grpc_slice_from_static_buffer(value.data(), value.size()));
+    }
+};
+
+// OTLP signal, each one is exported with its own service
+enum class Signal {
+    Traces,
+    Metrics,
+    Logs
+};
+
+// Sends serialized OTLP export requests, e.g. ExportTraceServiceRequest,
+// to a collector.
+class ExportClient {
+public:
+    typedef std::function<StrView ()> RequestCb;
+
+    // Returns delay to retry request after, negative if it's done.
+    typedef std::function<std::chrono::milliseconds (grpc::ByteBuffer,
+        grpc::Status)> ResponseCb;
+
+    virtual ~ExportClient() {}
+
+    // Sends request obtained from 'getRequest', which may be called on
+    // another thread, and again on retry. The data is not copied and must
+    // stay intact until the callback is called.
+    virtual void send(RequestCb getRequest, ResponseCb cb) = 0;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Hex coding of trace and span IDs, 16 digits at a time with SSE2.
+
+// Decodes 'size' bytes from 2 * 'size' hex digits of either case.
+// Fails on any other character.
+inline bool decodeHex(const char* in, uint8_t* out, size_t size)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 8 <= size; i += 8) {
+        auto c = _mm_loadu_si128((const __m128i*)(in + i * 2));
+        auto l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+        // bytes over 0x7f are negative and fail both ranges
+        auto digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+        auto alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+
+        if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) {
+            return false;
+        }
+
+        auto nibbles = _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+            _mm_and_si128(alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+
+        // high nibble comes first, i.e. in the low byte of each pair
+        auto bytes = _mm_or_si128(
+            _mm_and_si128(_mm_slli_epi16(nibbles, 4), _mm_set1_epi16(0xf0)),
+            _mm_srli_epi16(nibbles, 8));
+
+        _mm_storel_epi64((__m128i*)(out + i),
+            _mm_packus_epi16(bytes, bytes));
+    }
+#endif
+
+    for ( ; i < size; i++) {
+        int b = 0;
+
+        for (int j = 0; j < 2; j++) {
+            char c = in[i * 2 + j];
+            char l = c | 0x20;
+
+            int n;
+            if (c >= '0' && c <= '9') {
+                n = c - '0';
+            } else if (l >= 'a' && l <= 'f') {
+                n = l - 'a' + 10;
+            } else {
+                return false;
+            }
+
+            b = b << 4 | n;
+        }
+
+        out[i] = b;
+    }
+
+    return true;
+}
+
+// Writes 2 * 'size' lowercase hex digits.
+inline void encodeHex(const uint8_t* in, size_t size, char* out)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 8 <= size; i += 8) {
+        auto v = _mm_loadl_epi64((const __m128i*)(in + i));
+        auto mask = _mm_set1_epi8(0x0f);
+
+        auto nibbles = _mm_unpacklo_epi8(
+            _mm_and_si128(_mm_srli_epi16(v, 4), mask),
+            _mm_and_si128(v, mask));
+
+        // 'a' - '0' - 10 more for digits over 9
+        auto alpha = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)),
+            _mm_set1_epi8('a' - '0' - 10));
+
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_add_epi8(nibbles,
+            _mm_add_epi8(alpha, _mm_set1_epi8('0'))));
+    }
+#endif
+
+    for ( ; i < size; i++) {
+        out[i * 2] = "0123456789abcdef"[in[i] >> 4];
+        out[i * 2 + 1] = "0123456789abcdef"[in[i] & 0xf];
+    }
+}
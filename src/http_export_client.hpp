@@ -0,0 +1,520 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+
+#include "ngx.hpp"
+
+#include "export_client.hpp"
+#include "proto_writer.hpp"
+
+// OTLP/HTTP client driven by the worker event loop, so it needs no threads.
+// Requests are sent one by one over a keepalive HTTP/1.1 connection.
+class HttpExportClient : public ExportClient {
+public:
+    HttpExportClient(const Target& target, const ngx_url_t& url,
+            ngx_log_t* log, Signal signal = Signal::Traces) :
+        url(url), log(log)
+    {
+        path = url.uri.len ? toString(url.uri) : "/v1/traces";
+
+        // endpoint URI is for traces, other signals keep its prefix
+        if (signal != Signal::Traces) {
+            StrView suffix("/v1/traces");
+
+            if (path.size() >= suffix.size() && path.compare(
+                    path.size() - suffix.size(), suffix.size(),
+                    suffix.data(), suffix.size()) == 0) {
+                path.resize(path.size() - suffix.size());
+            } else {
+                path.clear();
+            }
+
+            path += signal == Signal::Metrics ? "/v1/metrics" : "/v1/logs";
+        }
+        host = toString(url.host) + ':' + std::to_string(url.port);
+
+        for (auto& header : target.headers) {
+            headers += header.first + ": " + header.second + "\r\n";
+        }
+
+        retryConn.data = this;
+        retryConn.fd = (ngx_socket_t)-1;
+
+        retryEvent.data = &retryConn;
+        retryEvent.log = log;
+        retryEvent.handler = [](ngx_event_t* ev) {
+            auto c = (ngx_connection_t*)ev->data;
+            ((HttpExportClient*)c->data)->startRequest();
+        };
+    }
+
+    ~HttpExportClient()
+    {
+        if (retryEvent.timer_set) {
+            ngx_del_timer(&retryEvent);
+        }
+
+        if (conn) {
+            ngx_close_connection(conn);
+        }
+    }
+
+    // 'getRequest' is called right away, if no other request is active
+    void send(RequestCb getRequest, ResponseCb cb) override
+    {
+        pending.push_back(Call{std::move(getRequest), std::move(cb)});
+
+        if (!active && !retryEvent.timer_set) {
+            startRequest();
+        }
+    }
+
+private:
+    struct Call {
+        RequestCb getRequest;
+        ResponseCb cb;
+    };
+
+    static const ngx_msec_t Timeout = 10000;
+
+    static std::string toString(ngx_str_t str)
+    {
+        return std::string((char*)str.data, str.len);
+    }
+
+    void startRequest()
+    {
+        if (pending.empty()) {
+            return;
+        }
+
+        active = true;
+
+        body = pending.front().getRequest();
+
+        request = "POST " + path + " HTTP/1.1\r\n"
+            "Host: " + host + "\r\n"
+            "Content-Type: application/x-protobuf\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+            headers + "\r\n";
+        sent = 0;
+
+        response.clear();
+
+        if (conn == NULL) {
+            connect();
+            return;
+        }
+
+        // reused connection may be closed by peer at any moment
+        reused = true;
+
+        conn->idle = 0;
+        onWrite(conn->write);
+    }
+
+    void connect()
+    {
+        auto& addr = url.addrs[nextAddr++ % url.naddrs];
+
+        ngx_peer_connection_t peer{};
+        peer.sockaddr = addr.sockaddr;
+        peer.socklen = addr.socklen;
+        peer.name = &addr.name;
+        peer.get = ngx_event_get_peer;
+        peer.log = log;
+        peer.log_error = NGX_ERROR_ERR;
+
+        auto rc = ngx_event_connect_peer(&peer);
+        if (rc == NGX_ERROR || rc == NGX_DECLINED) {
+            finish(grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                "failed to connect"));
+            return;
+        }
+
+        conn = peer.connection;
+        conn->data = this;
+        conn->read->handler = [](ngx_event_t* ev) {
+            auto c = (ngx_connection_t*)ev->data;
+            ((HttpExportClient*)c->data)->onRead(ev);
+        };
+        conn->write->handler = [](ngx_event_t* ev) {
+            auto c = (ngx_connection_t*)ev->data;
+            ((HttpExportClient*)c->data)->onWrite(ev);
+        };
+
+        reused = false;
+
+        if (rc == NGX_AGAIN) {
+            ngx_add_timer(conn->write, Timeout);
+            return;
+        }
+
+        onWrite(conn->write);
+    }
+
+    void onWrite(ngx_event_t* ev)
+    {
+        if (ev->timedout) {
+            reused = false;
+            fail("timed out");
+            return;
+        }
+
+        if (!active) {
+            return;
+        }
+
+        while (sent < request.size() + body.size()) {
+            auto buf = sent < request.size() ?
+                StrView(request).substr(sent) :
+                body.substr(sent - request.size());
+
+            auto n = conn->send(conn, (u_char*)buf.data(), buf.size());
+
+            if (n == NGX_AGAIN) {
+                if (!ev->timer_set) {
+                    ngx_add_timer(ev, Timeout);
+                }
+
+                if (ngx_handle_write_event(ev, 0) != NGX_OK) {
+                    fail("failed to send");
+                }
+                return;
+            }
+
+            if (n == NGX_ERROR) {
+                fail("failed to send");
+                return;
+            }
+
+            sent += n;
+        }
+
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
+
+        ngx_add_timer(conn->read, Timeout);
+
+        onRead(conn->read);
+    }
+
+    void onRead(ngx_event_t* ev)
+    {
+        if (ev->timedout) {
+            reused = false;
+            fail("timed out");
+            return;
+        }
+
+        // idle keepalive connection is closed, or worker is exiting
+        if (!active || conn->close) {
+            if (active) {
+                fail("connection closed");
+            } else {
+                closeConnection();
+            }
+            return;
+        }
+
+        for ( ;; ) {
+            u_char buf[4096];
+
+            auto n = conn->recv(conn, buf, sizeof(buf));
+
+            if (n == NGX_AGAIN) {
+                if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+                    fail("failed to read response");
+                }
+                return;
+            }
+
+            if (n == NGX_ERROR) {
+                fail("failed to read response");
+                return;
+            }
+
+            if (n == 0) {
+                if (!parseResponse(true)) {
+                    fail("connection closed prematurely");
+                }
+                return;
+            }
+
+            response.append((char*)buf, n);
+
+            if (parseResponse(false)) {
+                return;
+            }
+        }
+    }
+
+    // returns true and finishes request if response is complete
+    bool parseResponse(bool eof)
+    {
+        auto headerEnd = response.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            return false;
+        }
+
+        int status = 0;
+        if (std::sscanf(response.c_str(), "HTTP/1.%*d %3d", &status) != 1) {
+            fail("invalid response");
+            return true;
+        }
+
+        bool keepalive = response.compare(0, 8, "HTTP/1.1") == 0;
+        bool chunked = false;
+        size_t contentLength = std::string::npos;
+        long retryAfter = -1;
+
+        for (size_t pos = response.find("\r\n") + 2; pos < headerEnd; ) {
+            auto end = response.find("\r\n", pos);
+            auto colon = response.find(':', pos);
+
+            if (colon < end) {
+                auto name = StrView(response).substr(pos, colon - pos);
+
+                auto valuePos = std::min(
+                    response.find_first_not_of(' ', colon + 1), end);
+                auto value = StrView(response).substr(valuePos,
+                    end - valuePos);
+
+                if (equalsLower(name, "content-length")) {
+                    contentLength = std::strtoul(value.data(), NULL, 10);
+
+                } else if (equalsLower(name, "transfer-encoding")) {
+                    chunked = equalsLower(value, "chunked");
+
+                } else if (equalsLower(name, "connection")) {
+                    keepalive = !equalsLower(value, "close");
+
+                } else if (equalsLower(name, "retry-after")) {
+                    char* end;
+                    retryAfter = std::strtol(value.data(), &end, 10);
+                    if (end == value.data()) {
+                        retryAfter = -1;
+                    }
+                }
+            }
+
+            pos = end + 2;
+        }
+
+        std::string body;
+        size_t bodyPos = headerEnd + 4;
+
+        if (chunked) {
+            auto rc = decodeChunked(response, bodyPos, body);
+            if (rc == NGX_AGAIN) {
+                return false;
+            }
+
+            if (rc == NGX_ERROR) {
+                fail("invalid response");
+                return true;
+            }
+
+        } else if (contentLength != std::string::npos) {
+            if (response.size() - bodyPos < contentLength) {
+                return false;
+            }
+            body = response.substr(bodyPos, contentLength);
+
+        } else {
+            // body ends with connection close
+            if (!eof) {
+                return false;
+            }
+            body = response.substr(bodyPos);
+            keepalive = false;
+        }
+
+        if (!keepalive || eof) {
+            closeConnection();
+        }
+
+        if (status >= 200 && status < 300) {
+            grpc::Slice slice(body.data(), body.size());
+
+            finish(grpc::ByteBuffer(&slice, 1), grpc::Status::OK);
+
+        } else {
+            finish(grpc::ByteBuffer(), toStatus(status, body, retryAfter));
+        }
+
+        return true;
+    }
+
+    static ngx_int_t decodeChunked(const std::string& data, size_t pos,
+        std::string& body)
+    {
+        for ( ;; ) {
+            auto lineEnd = data.find("\r\n", pos);
+            if (lineEnd == std::string::npos) {
+                return NGX_AGAIN;
+            }
+
+            char* end;
+            size_t size = std::strtoul(&data[pos], &end, 16);
+            if (end == &data[pos]) {
+                return NGX_ERROR;
+            }
+
+            pos = lineEnd + 2;
+
+            if (size == 0) {
+                // trailers are not expected
+                return data.compare(pos, 2, "\r\n") == 0 ?
+                    NGX_OK : NGX_AGAIN;
+            }
+
+            if (data.size() - pos < size + 2) {
+                return NGX_AGAIN;
+            }
+
+            body.append(data, pos, size);
+            pos += size + 2;
+        }
+    }
+
+    static bool equalsLower(StrView str, StrView lower)
+    {
+        return str.size() == lower.size() && ngx_strncasecmp(
+            (u_char*)str.data(), (u_char*)lower.data(), str.size()) == 0;
+    }
+
+    // Maps HTTP status code as gRPC does. Error response body is serialized
+    // google.rpc.Status, and throttling hint from Retry-After header is added
+    // to its details as google.rpc.RetryInfo, like in gRPC.
+    static grpc::Status toStatus(int status, std::string details,
+        long retryAfter)
+    {
+        grpc::StatusCode code;
+
+        switch (status) {
+        case 400:
+            code = grpc::StatusCode::INTERNAL;
+            break;
+        case 401:
+            code = grpc::StatusCode::UNAUTHENTICATED;
+            break;
+        case 403:
+            code = grpc::StatusCode::PERMISSION_DENIED;
+            break;
+        case 404:
+            code = grpc::StatusCode::UNIMPLEMENTED;
+            break;
+        case 429:
+        case 502:
+        case 503:
+        case 504:
+            code = grpc::StatusCode::UNAVAILABLE;
+            break;
+        default:
+            code = grpc::StatusCode::UNKNOWN;
+        }
+
+        if (retryAfter >= 0) {
+            ProtoWriter out(details);
+
+            // Status.details
+            auto anyPos = out.begin(3);
+            out.bytes(1, StrView("type.googleapis.com/google.rpc.RetryInfo"));
+
+            auto infoPos = out.begin(2);
+            auto delayPos = out.begin(1);   // RetryInfo.retry_delay
+            out.varint(1, retryAfter);      // Duration.seconds
+            out.end(delayPos);
+            out.end(infoPos);
+
+            out.end(anyPos);
+        }
+
+        return grpc::Status(code, "HTTP status " + std::to_string(status),
+            details);
+    }
+
+    void fail(const char* error)
+    {
+        bool retry = reused && response.empty();
+
+        closeConnection();
+
+        // peer may have closed keepalive connection before getting request
+        if (retry) {
+            sent = 0;
+            response.clear();
+            connect();
+            return;
+        }
+
+        finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, error));
+    }
+
+    void finish(grpc::Status status)
+    {
+        finish(grpc::ByteBuffer(), std::move(status));
+    }
+
+    void finish(grpc::ByteBuffer response, grpc::Status status)
+    {
+        active = false;
+
+        if (conn) {
+            if (conn->read->timer_set) {
+                ngx_del_timer(conn->read);
+            }
+            conn->idle = 1;
+        }
+
+        auto delay = pending.front().cb(std::move(response),
+            std::move(status));
+
+        // later requests wait to keep order
+        if (delay.count() >= 0) {
+            ngx_add_timer(&retryEvent, delay.count());
+            return;
+        }
+
+        pending.pop_front();
+
+        startRequest();
+    }
+
+    void closeConnection()
+    {
+        if (conn) {
+            ngx_close_connection(conn);
+            conn = NULL;
+        }
+    }
+
+    const ngx_url_t& url;
+    ngx_log_t* log;
+
+    std::string path;
+    std::string host;
+    std::string headers;
+
+    ngx_connection_t* conn{NULL};
+    ngx_uint_t nextAddr{0};
+    bool reused{false};
+
+    ngx_event_t retryEvent{};
+    ngx_connection_t retryConn{};
+
+    std::deque<Call> pending;
+    bool active{false};
+
+    std::string request;
+    StrView body;
+    size_t sent;
+
+    std::string response;
+};
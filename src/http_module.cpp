@@ -4,17 +4,85 @@
 
 #include "str_view.hpp"
 #include "trace_context.hpp"
+#include "baggage.hpp"
+#include "trace_sampler.hpp"
+#include "token_bucket.hpp"
 #include "batch_exporter.hpp"
+#include "red_metrics.hpp"
+#include "metrics_exporter.hpp"
+#include "batch_tuner.hpp"
+#include "http_export_client.hpp"
+#include "trace_service_client.hpp"
+#include "span_ring.hpp"
+#include "shared_exporter.hpp"
 
 #include <fstream>
+#include <unordered_map>
 
 extern ngx_module_t gHttpModule;
 
 namespace {
 
+// Points of request processing recorded as span events. Content handlers
+// like proxy_pass bypass content phase handlers, so content start is only
+// seen as the end of access phase.
+namespace PhaseEvent {
+
+enum {
+    HeaderRead,
+    BodyRead,
+    PreaccessDone,
+    AccessDone,
+    ResponseHeader,
+    ResponseEnd,
+    Count
+};
+
+const char* const Names[] = {
+    "nginx.request_header_read",
+    "nginx.request_body_read",
+    "nginx.preaccess_done",
+    "nginx.access_done",
+    "nginx.response_header",
+    "nginx.response_end"
+};
+
+}
+
 struct OtelCtx {
     TraceContext parent;
     TraceContext current;
+
+    // of this span at this hop, if sampler was applied
+    double samplingProbability;
+
+    // of the first upstream attempt, passed to upstream as parent
+    opentelemetry::trace::SpanId upstreamSpanId;
+
+    // in milliseconds, indexed by PhaseEvent
+    uint64_t phaseTimes[PhaseEvent::Count];
+};
+
+// Locations with the same key share the bucket. It's kept across reloads
+// for the same key, so the key doesn't depend on directive order.
+struct RateLimit {
+    // "<server index>:<server name>:<location>:<rate>"
+    ngx_str_t key;
+    ngx_uint_t rate;
+
+    // set on zone init
+    TokenBucket* bucket;
+};
+
+// room for about a thousand buckets
+const size_t RateZoneSize = 256 * 1024;
+
+// list of buckets in shared zone
+struct RateNode {
+    RateNode* next;
+    TokenBucket* bucket;
+    size_t keyLen;
+    u_char key[1];
 };
 
 struct MainConfBase {
@@ -22,6 +90,19 @@ struct MainConfBase {
     ngx_msec_t interval;
     size_t batchSize;
     size_t batchCount;
+    ngx_uint_t compression;
+    ngx_uint_t protocol;
+    size_t channels;
+    size_t maxInFlight;
+    ngx_str_t spillDir;
+    size_t spillSize;
+    ngx_flag_t adaptive;
+    size_t minBatchSize;
+    ngx_msec_t minInterval;
+    size_t priorityReserve;
+    ngx_msec_t metricsInterval;
+    size_t metricsZoneSize;
+    ngx_flag_t metricsExemplars;
 
     ngx_str_t serviceName;
 };
@@ -31,6 +112,23 @@ struct MainConf : MainConfBase {
     bool ssl;
     std::string trustedCert;
     Target::HeaderVec headers;
+
+    ngx_shm_zone_t* sharedZone;
+
+    ngx_url_t httpUrl;
+
+    // enabled in any location
+    bool phaseEvents;
+    bool metrics;
+
+    // error_log chains of locations with otel_logs
+    std::vector<ngx_log_t*> logChains;
+
+    ngx_shm_zone_t* metricsZone;
+
+    // of otel_sampler rate_limit, all buckets live in one zone
+    std::vector<RateLimit*> rateLimits;
+    ngx_shm_zone_t* rateZone;
 };
 
 struct SpanAttr {
@@ -41,9 +139,31 @@ struct SpanAttr {
 struct LocationConf {
     ngx_http_complex_value_t* trace;
     ngx_uint_t traceContext;
+    ngx_uint_t contextFormats;
+    // the same formats in the order listed, 4 bits each
+    ngx_uint_t contextOrder;
+
+    TraceSampler* sampler;
+    RateLimit* rateLimit;
 
     ngx_http_complex_value_t* spanName;
     ngx_array_t spanAttrs;
+
+    // constant attributes encoded for plain and SSL listeners
+    ngx_str_t spanTemplate[2];
+    ngx_array_t dynamicAttrs;
+
+    ngx_http_complex_value_t* spanPriority;
+    ngx_msec_t priorityLatency;
+
+    ngx_flag_t traceOnError;
+    ngx_msec_t traceLatency;
+
+    ngx_flag_t upstreamSpans;
+    ngx_flag_t phaseEvents;
+
+    ngx_flag_t metrics;
+    ngx_uint_t logs;
 };
 
 char* setExporter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
@@ -51,6 +171,10 @@ char* addResourceAttr(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 char* addSpanAttr(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 char* setTrustedCertificate(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 char* addExporterHeader(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* setSharedZone(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* setTraceOverride(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* setSampler(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* setTraceContext(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 
 namespace Propagation {
 
@@ -65,6 +189,83 @@ const ngx_uint_t Inject = 2;
     { ngx_null_string, 0 }
 };
 
+const ngx_uint_t W3C = 1;
+const ngx_uint_t B3 = 2;
+const ngx_uint_t B3Multi = 4;
+const ngx_uint_t Jaeger = 8;
+
+/*const*/ ngx_conf_bitmask_t Formats[] = {
+    { ngx_string("w3c"), W3C },
+    { ngx_string("b3"), B3 },
+    { ngx_string("b3multi"), B3Multi },
+    { ngx_string("jaeger"), Jaeger },
+    { ngx_null_string, 0 }
+};
+
+// headers of all formats, looked up in one pass over request headers
+enum Header {
+    Traceparent,
+    Tracestate,
+    B3Single,
+    B3TraceId,
+    B3SpanId,
+    B3Sampled,
+    B3Flags,
+    UberTraceId,
+    HeaderCount
+};
+
+struct HeaderName {
+    StrView name;
+    ngx_uint_t format;
+    ngx_uint_t hash;
+};
+
+// hashes are set on postconfiguration
+HeaderName Headers[] = {
+    { "traceparent", W3C, 0 },
+    { "tracestate", W3C, 0 },
+    { "b3", B3, 0 },
+    { "x-b3-traceid", B3Multi, 0 },
+    { "x-b3-spanid", B3Multi, 0 },
+    { "x-b3-sampled", B3Multi, 0 },
+    { "x-b3-flags", B3Multi, 0 },
+    { "uber-trace-id", Jaeger, 0 }
+};
+
+}
+
+/*const*/ ngx_conf_enum_t CompressionTypes[] = {
+    { ngx_string("none"), GRPC_COMPRESS_NONE },
+    { ngx_string("deflate"), GRPC_COMPRESS_DEFLATE },
+    { ngx_string("gzip"), GRPC_COMPRESS_GZIP },
+    { ngx_null_string, 0 }
+};
+
+// error_log levels, up to which records are exported with otel_logs
+/*const*/ ngx_conf_enum_t LogLevels[] = {
+    { ngx_string("off"), 0 },
+    { ngx_string("emerg"), NGX_LOG_EMERG },
+    { ngx_string("alert"), NGX_LOG_ALERT },
+    { ngx_string("crit"), NGX_LOG_CRIT },
+    { ngx_string("error"), NGX_LOG_ERR },
+    { ngx_string("warn"), NGX_LOG_WARN },
+    { ngx_string("notice"), NGX_LOG_NOTICE },
+    { ngx_string("info"), NGX_LOG_INFO },
+    { ngx_null_string, 0 }
+};
+
+namespace Protocol {
+
+const ngx_uint_t Grpc = 0;
+const ngx_uint_t Http = 1;
+
+/*const*/ ngx_conf_enum_t Types[] = {
+    { ngx_string("grpc"), Grpc },
+    { ngx_string("http"), Http },
+    { ngx_null_string, 0 }
+};
+
 }
 
 ngx_command_t gCommands[] = {
@@ -89,12 +290,15 @@ ngx_command_t gCommands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(LocationConf, trace) },
 
+    { ngx_string("otel_sampler"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      setSampler,
+      NGX_HTTP_LOC_CONF_OFFSET },
+
     { ngx_string("otel_trace_context"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_enum_slot,
-      NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(LocationConf, traceContext),
-      &Propagation::Types },
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      setTraceContext,
+      NGX_HTTP_LOC_CONF_OFFSET },
 
     { ngx_string("otel_span_name"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -107,6 +311,48 @@ ngx_command_t gCommands[] = {
       addSpanAttr,
       NGX_HTTP_LOC_CONF_OFFSET },
 
+    { ngx_string("otel_span_priority"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, spanPriority) },
+
+    { ngx_string("otel_span_priority_latency"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, priorityLatency) },
+
+    { ngx_string("otel_trace_override"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      setTraceOverride,
+      NGX_HTTP_LOC_CONF_OFFSET },
+
+    { ngx_string("otel_upstream_spans"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, upstreamSpans) },
+
+    { ngx_string("otel_phase_events"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, phaseEvents) },
+
+    { ngx_string("otel_metrics"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, metrics) },
+
+    { ngx_string("otel_logs"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(LocationConf, logs),
+      &LogLevels },
+
       ngx_null_command
 };
 
@@ -144,10 +390,146 @@ ngx_command_t gExporterCommands[] = {
       0,
       offsetof(MainConfBase, batchCount) },
 
+    { ngx_string("shared_zone"),
+      NGX_CONF_TAKE1,
+      setSharedZone },
+
+    { ngx_string("compression"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(MainConfBase, compression),
+      &CompressionTypes },
+
+    { ngx_string("protocol"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(MainConfBase, protocol),
+      &Protocol::Types },
+
+    { ngx_string("channels"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, channels) },
+
+    { ngx_string("max_in_flight"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, maxInFlight) },
+
+    { ngx_string("spill_dir"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      0,
+      offsetof(MainConfBase, spillDir) },
+
+    { ngx_string("spill_size"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, spillSize) },
+
+    { ngx_string("adaptive"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(MainConfBase, adaptive) },
+
+    { ngx_string("min_batch_size"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, minBatchSize) },
+
+    { ngx_string("min_interval"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(MainConfBase, minInterval) },
+
+    { ngx_string("priority_reserve"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, priorityReserve) },
+
+    { ngx_string("metrics_interval"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(MainConfBase, metricsInterval) },
+
+    { ngx_string("metrics_zone_size"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(MainConfBase, metricsZoneSize) },
+
+    { ngx_string("metrics_exemplars"),
+      NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(MainConfBase, metricsExemplars) },
+
       ngx_null_command
 };
 
 std::unique_ptr<BatchExporter> gExporter;
+std::unique_ptr<BatchTuner> gBatchTuner;
+
+// set in all workers if spans are exported by a single worker
+SpanRing* gSpanRing;
+bool gSpanRingOwner;
+
+std::unique_ptr<MetricsExporter> gMetricsExporter;
+
+std::unique_ptr<BatchExporter> gLogExporter;
+ngx_http_log_handler_pt gPrevLogHandler;
+
+// Request of error_log line being written and the level set for its
+// location, passed from request log handler to log writer. The exporter
+// threads also write to error_log, but never set them.
+thread_local ngx_http_request_t* gLogRequest;
+thread_local ngx_uint_t gLogLevel;
+
+// set in all workers if metrics are enabled
+RedMetrics* gRedMetrics;
+ngx_slab_pool_t* gMetricsPool;
+bool gMetricsExemplars;
+
+struct MetricsKey {
+    const LocationConf* lcf;
+    ngx_uint_t method;
+    ngx_uint_t statusClass;
+
+    bool operator==(const MetricsKey& other) const
+    {
+        return lcf == other.lcf && method == other.method &&
+            statusClass == other.statusClass;
+    }
+};
+
+struct MetricsKeyHash {
+    size_t operator()(const MetricsKey& key) const
+    {
+        return std::hash<const void*>()(key.lcf) ^
+            (key.method << 3) ^ key.statusClass;
+    }
+};
+
+// cells of this worker, NULL if zone was full
+std::unordered_map<MetricsKey, RedMetrics::Cell*, MetricsKeyHash>
+    gMetricsCells;
+
+ngx_http_request_body_filter_pt gNextRequestBodyFilter;
+ngx_http_output_header_filter_pt gNextHeaderFilter;
+ngx_http_output_body_filter_pt gNextBodyFilter;
+
+const ngx_msec_t MaxDrainInterval = 100;
+const ngx_msec_t ExitFlushInterval = 100;
 
 StrView toStrView(ngx_str_t str)
 {
@@ -306,274 +688,1188 @@ ngx_int_t setHeader(ngx_http_request_t* r, StrView name, StrView value)
     return updateRequestHeader(r, header);
 }
 
-TraceContext extract(ngx_http_request_t* r)
+// formats are tried in 'order' till valid context is found
+TraceContext extract(ngx_http_request_t* r, ngx_uint_t formats,
+    ngx_uint_t order)
 {
-    auto parent = getHeader(r, "traceparent");
-    auto state = getHeader(r, "tracestate");
+    using namespace Propagation;
 
-    return TraceContext::parse(parent, state);
-}
+    StrView values[HeaderCount];
 
-ngx_int_t inject(ngx_http_request_t* r, const TraceContext& tc)
-{
-    auto buf = (char*)ngx_pnalloc(r->pool, TraceContext::Size);
-    if (buf == NULL) {
-        return NGX_ERROR;
+    auto part = &r->headers_in.headers.part;
+    auto elts = (ngx_table_elt_t*)part->elts;
+
+    for (ngx_uint_t i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            elts = (ngx_table_elt_t*)part->elts;
+            i = 0;
+        }
+
+        for (int h = 0; h < HeaderCount; h++) {
+            auto& header = Headers[h];
+
+            if ((header.format & formats) && elts[i].hash == header.hash &&
+                    values[h].empty() &&
+                    elts[i].key.len == header.name.size() &&
+                    ngx_memcmp(elts[i].lowcase_key, header.name.data(),
+                        header.name.size()) == 0) {
+                values[h] = toStrView(elts[i].value);
+                break;
+            }
+        }
     }
 
-    TraceContext::serialize(tc, buf);
+    TraceContext tc{};
+
+    for ( /* void */ ; order && !tc.traceId.IsValid(); order >>= 4) {
+        switch (order & 0xf) {
+        case W3C:
+            tc = TraceContext::parse(values[Traceparent], values[Tracestate]);
+            break;
+
+        case B3:
+            tc = TraceContext::parseB3(values[B3Single]);
+            break;
 
-    auto rc = setHeader(r, "traceparent", {buf, TraceContext::Size});
-    if (rc != NGX_OK) {
-        return rc;
+        case B3Multi:
+            tc = TraceContext::parseB3Multi(values[B3TraceId],
+                values[B3SpanId], values[B3Sampled], values[B3Flags]);
+            break;
+
+        case Jaeger:
+            tc = TraceContext::parseJaeger(values[UberTraceId]);
+            break;
+        }
     }
 
-    return setHeader(r, "tracestate", tc.state);
+    return tc.traceId.IsValid() ? tc : TraceContext{};
 }
 
-OtelCtx* ensureOtelCtx(ngx_http_request_t* r)
+ngx_int_t inject(ngx_http_request_t* r, const TraceContext& tc,
+    ngx_uint_t formats)
 {
-    auto ctx = getOtelCtx(r);
-    if (ctx) {
-        return ctx;
-    }
+    using namespace Propagation;
 
-    ctx = createOtelCtx(r);
-    if (!ctx) {
-        return NULL;
-    }
+    ngx_int_t rc;
 
-    auto lcf = getLocationConf(r);
-    if (lcf->traceContext & Propagation::Extract) {
-        ctx->parent = extract(r);
+    if (formats & W3C) {
+        auto buf = (char*)ngx_pnalloc(r->pool, TraceContext::Size);
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        TraceContext::serialize(tc, buf);
+
+        rc = setHeader(r, "traceparent", {buf, TraceContext::Size});
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        rc = setHeader(r, "tracestate", tc.state);
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    ctx->current = TraceContext::generate(false, ctx->parent);
+    if (formats & B3) {
+        auto buf = (char*)ngx_pnalloc(r->pool, TraceContext::B3Size);
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
 
-    return ctx;
-}
+        TraceContext::serializeB3(tc, buf);
 
-ngx_int_t onRequestStart(ngx_http_request_t* r)
-{
-    // don't let internal redirects to override sampling decision
-    if (r->internal) {
-        return NGX_DECLINED;
+        rc = setHeader(r, "b3", {buf, TraceContext::B3Size});
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    bool sampled = false;
+    if (formats & B3Multi) {
+        auto traceId = tc.traceId.Id();
+        auto spanId = tc.spanId.Id();
 
-    auto lcf = getLocationConf(r);
-    if (lcf->trace != NULL) {
-        ngx_str_t trace;
-        if (ngx_http_complex_value(r, lcf->trace, &trace) != NGX_OK) {
+        auto buf = (char*)ngx_pnalloc(r->pool,
+            (traceId.size() + spanId.size()) * 2);
+        if (buf == NULL) {
             return NGX_ERROR;
         }
 
-        sampled = toStrView(trace) == "on" || toStrView(trace) == "1";
-    }
+        encodeHex(traceId.data(), traceId.size(), buf);
+        encodeHex(spanId.data(), spanId.size(), buf + traceId.size() * 2);
 
-    if (!lcf->traceContext && !sampled) {
-        return NGX_DECLINED;
-    }
+        rc = setHeader(r, "x-b3-traceid", {buf, traceId.size() * 2});
+        if (rc != NGX_OK) {
+            return rc;
+        }
 
-    auto ctx = ensureOtelCtx(r);
-    if (!ctx) {
-        return NGX_ERROR;
+        rc = setHeader(r, "x-b3-spanid",
+            {buf + traceId.size() * 2, spanId.size() * 2});
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        rc = setHeader(r, "x-b3-sampled", tc.sampled ? "1" : "0");
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    ctx->current.sampled = sampled;
+    if (formats & Jaeger) {
+        auto buf = (char*)ngx_pnalloc(r->pool, TraceContext::JaegerSize);
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
 
-    ngx_int_t rc = NGX_OK;
+        TraceContext::serializeJaeger(tc, buf);
 
-    if (lcf->traceContext & Propagation::Inject) {
-        rc = inject(r, ctx->current);
+        rc = setHeader(r, "uber-trace-id", {buf, TraceContext::JaegerSize});
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    return rc == NGX_OK ? NGX_DECLINED : rc;
+    return NGX_OK;
 }
 
-StrView getServerName(ngx_http_request_t* r)
+void writeLog(ngx_log_t* log, ngx_uint_t level, u_char* buf, size_t len)
 {
-    auto cscf = (ngx_http_core_srv_conf_t*)
-        ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+    auto r = gLogRequest;
+    gLogRequest = NULL;
 
-    auto name = cscf->server_name;
-    if (name.len == 0) {
-        name = r->headers_in.server;
+    if (r == NULL || level > gLogLevel || !gLogExporter) {
+        return;
     }
 
-    return toStrView(name);
-}
+    auto ctx = getOtelCtx(r);
+    if (ctx == NULL) {
+        return;
+    }
 
-void addDefaultAttrs(BatchExporter::Span& span, ngx_http_request_t* r)
-{
-    // based on trace semantic conventions for HTTP from 1.16.0 OTel spec
+    struct Severity {
+        uint32_t number;
+        StrView text;
+    };
 
-    span.add("http.method", toStrView(r->method_name));
+    // OTLP SeverityNumber by error_log level
+    static const Severity severities[] = {
+        { 0, "" },
+        { 21, "emerg" },
+        { 19, "alert" },
+        { 18, "crit" },
+        { 17, "error" },
+        { 13, "warn" },
+        { 10, "notice" },
+        { 9, "info" }
+    };
 
-    span.add("http.target", toStrView(r->unparsed_uri));
+    // "<time> [<level>] <pid>#<tid>: *<connection> <message>\n"
+    StrView line((char*)buf, len);
 
-    auto clcf = (ngx_http_core_loc_conf_t*)
-        ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    if (clcf->name.len) {
-        span.add("http.route", toStrView(clcf->name));
+    auto pos = line.find(']');
+    if (pos != StrView::npos) {
+        pos = line.find(':', pos);
     }
 
-    span.add("http.scheme", r->connection->ssl ? "https" : "http");
+    if (pos != StrView::npos) {
+        line = line.substr(pos + 2);
 
-    auto protocol = toStrView(r->http_protocol);
-    if (protocol.size() > 5) { // "HTTP/"
-        span.add("http.flavor", protocol.substr(5));
+        if (!line.empty() && line.data()[0] == '*') {
+            pos = line.find(' ');
+            line = pos == StrView::npos ? StrView() : line.substr(pos + 1);
+        }
     }
 
-    if (r->headers_in.user_agent) {
-        span.add("http.user_agent", toStrView(r->headers_in.user_agent->value));
+    if (!line.empty() && line.data()[line.size() - 1] == '\n') {
+        line = line.substr(0, line.size() - 1);
     }
 
-    auto received = r->headers_in.content_length_n;
-    span.add("http.request_content_length", received > 0 ? received : 0);
-
-    auto sent = r->connection->sent - (off_t)r->header_size;
-    span.add("http.response_content_length", sent > 0 ? sent : 0);
+    auto& severity = severities[level];
+    auto tp = ngx_timeofday();
 
-    auto status = r->err_status ? r->err_status : r->headers_out.status;
-    if (status) {
-        span.add("http.status_code", status);
+    try {
+        // not reported if buffers are full, as it would be logged again
+        gLogExporter->addLog(ctx->current,
+            ((uint64_t)tp->sec * 1000 + tp->msec) * 1000000,
+            severity.number, severity.text, line);
+
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "OTel failed to add log record: %s", e.what());
+    }
+}
+
+// Called for each error_log line of request before it's passed to writers.
+// The request is only handed over if the chain being written has the writer
+// node, which follows its head, so that a line written elsewhere never
+// leaves it behind for writeLog().
+u_char* logHandler(ngx_http_request_t* r, ngx_http_request_t* sr, u_char* buf,
+    size_t len)
+{
+    auto next = r->connection->log->next;
+
+    gLogLevel = getLocationConf(sr)->logs;
+    gLogRequest = gLogLevel && next && next->writer == writeLog ? r : NULL;
+
+    return gPrevLogHandler(r, sr, buf, len);
+}
+
+OtelCtx* ensureOtelCtx(ngx_http_request_t* r)
+{
+    auto ctx = getOtelCtx(r);
+    if (ctx) {
+        return ctx;
+    }
+
+    ctx = createOtelCtx(r);
+    if (!ctx) {
+        return NULL;
+    }
+
+    // error_log is written with the handler of main request
+    if (gLogExporter && r->main->log_handler != logHandler) {
+        gPrevLogHandler = r->main->log_handler;
+        r->main->log_handler = logHandler;
+    }
+
+    auto lcf = getLocationConf(r);
+    if (lcf->traceContext & Propagation::Extract) {
+        ctx->parent = extract(r, lcf->contextFormats, lcf->contextOrder);
+    }
+
+    ctx->current = TraceContext::generate(false, ctx->parent);
+
+    return ctx;
+}
+
+// narrows down requests enabled with otel_trace
+ngx_int_t applySampler(ngx_http_request_t* r, OtelCtx* ctx)
+{
+    auto lcf = getLocationConf(r);
+    auto sampler = lcf->sampler;
+
+    bool local = sampler && !sampler->followsParent(ctx->parent);
+    bool sampled = sampler ? sampler->sample(ctx->parent, ctx->current) : true;
+    double probability = local ? sampler->probability() : 1;
+
+    if (sampled && lcf->rateLimit) {
+        auto bucket = lcf->rateLimit->bucket;
+        auto tp = ngx_timeofday();
+
+        sampled = bucket->take((uint64_t)tp->sec * 1000000 + tp->msec * 1000,
+            lcf->rateLimit->rate);
+
+        probability *= (double)bucket->share() / TokenBucket::ShareScale;
+    }
+
+    if (local) {
+        auto state = ctx->current.state;
+
+        auto buf = (char*)ngx_pnalloc(r->pool, TraceSampler::stateSize(state));
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->current.state = StrView(buf,
+            sampler->updateState(state, sampled, buf));
+    }
+
+    ctx->current.sampled = sampled;
+
+    if (sampled && (local || lcf->rateLimit)) {
+        ctx->samplingProbability = probability;
+    }
+
+    return NGX_OK;
+}
+
+// keeps the first time an event is reached, e.g. before internal redirect
+void markPhase(ngx_http_request_t* r, int event)
+{
+    if (!getLocationConf(r)->phaseEvents) {
+        return;
+    }
+
+    auto ctx = getOtelCtx(r);
+    if (ctx == NULL || ctx->phaseTimes[event]) {
+        return;
+    }
+
+    auto tp = ngx_timeofday();
+    ctx->phaseTimes[event] = (uint64_t)tp->sec * 1000 + tp->msec;
+}
+
+// runs before other access handlers, i.e. after limit_req delay
+ngx_int_t onAccessPhase(ngx_http_request_t* r)
+{
+    markPhase(r, PhaseEvent::PreaccessDone);
+    return NGX_DECLINED;
+}
+
+ngx_int_t onPrecontentPhase(ngx_http_request_t* r)
+{
+    markPhase(r, PhaseEvent::AccessDone);
+    return NGX_DECLINED;
+}
+
+bool hasLastBuf(ngx_chain_t* in)
+{
+    for (auto cl = in; cl; cl = cl->next) {
+        if (cl->buf->last_buf) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ngx_int_t requestBodyFilter(ngx_http_request_t* r, ngx_chain_t* in)
+{
+    if (hasLastBuf(in)) {
+        markPhase(r, PhaseEvent::BodyRead);
+    }
+
+    return gNextRequestBodyFilter(r, in);
+}
+
+ngx_int_t headerFilter(ngx_http_request_t* r)
+{
+    if (r == r->main) {
+        markPhase(r, PhaseEvent::ResponseHeader);
+    }
+
+    return gNextHeaderFilter(r);
+}
+
+ngx_int_t bodyFilter(ngx_http_request_t* r, ngx_chain_t* in)
+{
+    if (r == r->main && hasLastBuf(in)) {
+        markPhase(r, PhaseEvent::ResponseEnd);
+    }
+
+    return gNextBodyFilter(r, in);
+}
+
+ngx_int_t onRequestStart(ngx_http_request_t* r)
+{
+    // don't let internal redirects to override sampling decision
+    if (r->internal) {
+        return NGX_DECLINED;
+    }
+
+    bool sampled = false;
+
+    auto lcf = getLocationConf(r);
+    if (lcf->trace != NULL) {
+        ngx_str_t trace;
+        if (ngx_http_complex_value(r, lcf->trace, &trace) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        sampled = toStrView(trace) == "on" || toStrView(trace) == "1";
+    }
+
+    if (!lcf->traceContext && !sampled && !lcf->phaseEvents) {
+        return NGX_DECLINED;
+    }
+
+    auto ctx = ensureOtelCtx(r);
+    if (!ctx) {
+        return NGX_ERROR;
+    }
+
+    markPhase(r, PhaseEvent::HeaderRead);
+
+    ctx->current.sampled = sampled;
+
+    if (sampled && (lcf->sampler || lcf->rateLimit) &&
+            applySampler(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // Upstream request is created once, so only the first attempt is seen
+    // as parent by upstream, retries reuse its headers. Spans are recorded
+    // for it even if the request ends in location without them, as the ID
+    // may be injected.
+    if (lcf->upstreamSpans) {
+        ctx->upstreamSpanId =
+            TraceContext::generate(false, ctx->current).spanId;
+    }
+
+    ngx_int_t rc = NGX_OK;
+
+    if (lcf->traceContext & Propagation::Inject) {
+        auto tc = ctx->current;
+
+        if (ctx->upstreamSpanId.IsValid()) {
+            tc.spanId = ctx->upstreamSpanId;
+        }
+
+        rc = inject(r, tc, lcf->contextFormats);
+    }
+
+    return rc == NGX_OK ? NGX_DECLINED : rc;
+}
+
+ngx_uint_t getStatus(ngx_http_request_t* r)
+{
+    return r->err_status ? r->err_status : r->headers_out.status;
+}
+
+void addDefaultAttrs(BatchExporter::Span& span, ngx_http_request_t* r)
+{
+    // based on trace semantic conventions for HTTP from 1.16.0 OTel spec
+
+    span.add("http.method", toStrView(r->method_name));
+
+    span.add("http.target", toStrView(r->unparsed_uri));
+
+    // http.route, http.scheme and constant custom attributes
+    auto lcf = getLocationConf(r);
+    span.addEncoded(toStrView(lcf->spanTemplate[r->connection->ssl ? 1 : 0]));
+
+    auto protocol = toStrView(r->http_protocol);
+    if (protocol.size() > 5) { // "HTTP/"
+        span.add("http.flavor", protocol.substr(5));
+    }
+
+    if (r->headers_in.user_agent) {
+        span.add("http.user_agent", toStrView(r->headers_in.user_agent->value));
+    }
+
+    auto received = r->headers_in.content_length_n;
+    span.add("http.request_content_length", received > 0 ? received : 0);
+
+    auto sent = r->connection->sent - (off_t)r->header_size;
+    span.add("http.response_content_length", sent > 0 ? sent : 0);
+
+    auto status = getStatus(r);
+    if (status) {
+        span.add("http.status_code", status);
 
         if (status >= 500) {
             span.setError();
         }
-    }
+    }
+
+    auto cscf = (ngx_http_core_srv_conf_t*)
+        ngx_http_get_module_srv_conf(r, ngx_http_core_module);
+    if (cscf->server_name.len == 0) {
+        span.add("net.host.name", toStrView(r->headers_in.server));
+    }
+
+    if (ngx_connection_local_sockaddr(r->connection, NULL, 0) == NGX_OK) {
+        auto port = ngx_inet_get_port(r->connection->local_sockaddr);
+        auto defaultPort = r->connection->ssl ? 443 : 80;
+
+        if (port != defaultPort) {
+            span.add("net.host.port", port);
+        }
+    }
+
+    span.add("net.sock.peer.addr", toStrView(r->connection->addr_text));
+    span.add("net.sock.peer.port", ngx_inet_get_port(r->connection->sockaddr));
+}
+
+StrView getSpanName(ngx_http_request_t* r)
+{
+    auto lcf = getLocationConf(r);
+
+    if (lcf->spanName) {
+        ngx_str_t result;
+        if (ngx_http_complex_value(r, lcf->spanName, &result) != NGX_OK) {
+            throw std::runtime_error("failed to compute complex value");
+        }
+
+        return toStrView(result);
+    } else {
+        auto clcf = (ngx_http_core_loc_conf_t*)
+            ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        return toStrView(clcf->name);
+    }
+}
+
+template <class Attrs>
+void addCustomAttr(Attrs& attrs, StrView name, StrView value)
+{
+    if (startsWith(name, "http.request.header.") ||
+        startsWith(name, "http.response.header."))
+    {
+        //TODO: remove this once headers are supported natively
+        attrs.addArray(name, value);
+    } else {
+        attrs.add(name, value);
+    }
+}
+
+void addCustomAttrs(BatchExporter::Span& span, ngx_http_request_t* r)
+{
+    auto lcf = getLocationConf(r);
+    auto attrs = (SpanAttr*)lcf->dynamicAttrs.elts;
+
+    for (ngx_uint_t i = 0; i < lcf->dynamicAttrs.nelts; i++) {
+        ngx_str_t value;
+        if (ngx_http_complex_value(r, &attrs[i].value, &value) != NGX_OK) {
+            throw std::runtime_error("failed to compute complex value");
+        }
+
+        addCustomAttr(span, toStrView(attrs[i].name), toStrView(value));
+    }
+}
+
+// spans of failed, slow or marked requests are kept under backpressure
+bool isPrioritySpan(ngx_http_request_t* r, uint64_t duration)
+{
+    if (getStatus(r) >= 500) {
+        return true;
+    }
+
+    auto lcf = getLocationConf(r);
+
+    if (lcf->priorityLatency != NGX_CONF_UNSET_MSEC &&
+            duration >= lcf->priorityLatency * 1000000) {
+        return true;
+    }
+
+    if (lcf->spanPriority) {
+        ngx_str_t result;
+        if (ngx_http_complex_value(r, lcf->spanPriority, &result) != NGX_OK) {
+            throw std::runtime_error("failed to compute complex value");
+        }
+
+        return result.len && !(result.len == 1 && result.data[0] == '0');
+    }
+
+    return false;
+}
+
+// reason to record request that wasn't sampled at start, if any
+StrView getTraceOverride(ngx_http_request_t* r, uint64_t duration)
+{
+    auto lcf = getLocationConf(r);
+
+    if (lcf->traceOnError && getStatus(r) >= 500) {
+        return "error";
+    }
+
+    if (lcf->traceLatency != NGX_CONF_UNSET_MSEC &&
+            duration >= lcf->traceLatency * 1000000) {
+        return "latency";
+    }
+
+    return {};
+}
+
+template <class F>
+bool addSpan(const BatchExporter::SpanInfo& info, F fillSpan)
+{
+    if (gSpanRing) {
+        auto data = BatchExporter::encode(info, fillSpan);
+
+        return gSpanRing->push(data.size(), ngx_pid, [&data](char* buf) {
+            ngx_memcpy(buf, data.data(), data.size());
+        });
+    }
+
+    return gExporter->add(info, fillSpan);
+}
+
+void addUpstreamAttrs(BatchExporter::Span& span,
+    const ngx_http_upstream_state_t& state)
+{
+    auto peer = toStrView(*state.peer);
+
+    auto colon = peer.size();
+    while (colon > 0 && peer.data()[colon - 1] != ':') {
+        colon--;
+    }
+
+    // "unix:" paths have no port
+    auto port = colon == 0 ? NGX_ERROR :
+        ngx_atoi((u_char*)peer.data() + colon, peer.size() - colon);
+
+    if (port != NGX_ERROR) {
+        auto addr = peer.substr(0, colon - 1);
+
+        // IPv6 address is in brackets
+        if (addr.size() > 2 && addr.data()[0] == '[') {
+            addr = addr.substr(1, addr.size() - 2);
+        }
+
+        span.add("net.sock.peer.addr", addr);
+        span.add("net.sock.peer.port", port);
+
+    } else {
+        span.add("net.sock.peer.addr", peer);
+    }
+
+    if (state.status) {
+        span.add("http.status_code", state.status);
+
+        if (state.status >= 500) {
+            span.setError();
+        }
+    }
+
+    // in seconds, as $upstream_*_time variables
+    auto addTime = [&span](StrView key, ngx_msec_t time) {
+        if (time != (ngx_msec_t)-1) {
+            span.addDouble(key, time / 1000.0);
+        }
+    };
+
+    addTime("nginx.upstream.connect_time", state.connect_time);
+    addTime("nginx.upstream.header_time", state.header_time);
+    addTime("nginx.upstream.response_time", state.response_time);
+}
+
+// Adds CLIENT span for each upstream attempt. Only durations are kept for
+// them, so attempts are laid back to back, the last one ending with request.
+bool addUpstreamSpans(ngx_http_request_t* r, OtelCtx* ctx, uint64_t start,
+    uint64_t end, bool priority)
+{
+    if (r->upstream_states == NULL) {
+        return true;
+    }
+
+    auto states = (ngx_http_upstream_state_t*)r->upstream_states->elts;
+    auto count = r->upstream_states->nelts;
+
+    ngx_uint_t first = 0;
+    while (first < count && states[first].peer == NULL) {
+        first++;
+    }
+
+    for (ngx_uint_t i = count; i-- > first; ) {
+        auto& state = states[i];
+
+        // separates upstream requests after internal redirect
+        if (state.peer == NULL) {
+            continue;
+        }
+
+        auto time = state.response_time != (ngx_msec_t)-1 ?
+            (uint64_t)state.response_time * 1000000 : 0;
+        auto attemptStart = end - start > time ? end - time : start;
+
+        auto tc = TraceContext::generate(ctx->current.sampled, ctx->current);
+        if (i == first && ctx->upstreamSpanId.IsValid()) {
+            tc.spanId = ctx->upstreamSpanId;
+        }
+
+        BatchExporter::SpanInfo info{toStrView(r->method_name), tc,
+            ctx->current.spanId, attemptStart, end};
+
+        info.priority = priority;
+        info.client = true;
+
+        if (!addSpan(info, [&state](BatchExporter::Span& span) {
+                addUpstreamAttrs(span, state);
+            })) {
+            return false;
+        }
+
+        end = attemptStart;
+    }
+
+    return true;
+}
+
+// 'tc' is set if request is traced, to be used as exemplar
+void updateMetrics(ngx_http_request_t* r, uint64_t end, uint64_t duration,
+    const TraceContext* tc)
+{
+    auto lcf = getLocationConf(r);
+    if (!lcf->metrics || gRedMetrics == NULL) {
+        return;
+    }
+
+    auto status = getStatus(r);
+    ngx_uint_t statusClass = status >= 100 && status < 600 ? status / 100 : 0;
+
+    MetricsKey key{lcf, r->method, statusClass};
+
+    RedMetrics::Cell* cell;
+
+    auto it = gMetricsCells.find(key);
+    if (it != gMetricsCells.end()) {
+        cell = it->second;
+
+    } else {
+        auto clcf = (ngx_http_core_loc_conf_t*)
+            ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        ngx_shmtx_lock(&gMetricsPool->mutex);
+
+        cell = gRedMetrics->acquireCell(toStrView(clcf->name),
+            r->method != NGX_HTTP_UNKNOWN ? toStrView(r->method_name) :
+                StrView("_OTHER"),
+            statusClass, ngx_pid);
+
+        ngx_shmtx_unlock(&gMetricsPool->mutex);
+
+        if (cell == NULL) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "OTel metrics zone is full");
+        }
+
+        gMetricsCells.emplace(key, cell);
+    }
+
+    if (cell == NULL) {
+        return;
+    }
+
+    auto ms = duration / 1000000;
+
+    cell->add(ms);
+
+    if (tc && gMetricsExemplars) {
+        RedMetrics::Exemplar ex;
+
+        std::memcpy(ex.traceId, tc->traceId.Id().data(), sizeof(ex.traceId));
+        std::memcpy(ex.spanId, tc->spanId.Id().data(), sizeof(ex.spanId));
+        ex.time = end;
+        ex.value = ms;
+
+        cell->setExemplar(ex);
+    }
+}
+
+ngx_int_t onRequestEnd(ngx_http_request_t* r)
+{
+    auto now = ngx_timeofday();
+
+    auto toNanoSec = [](time_t sec, ngx_msec_t msec) -> uint64_t {
+        return (sec * 1000 + msec) * 1000000;
+    };
+
+    auto start = toNanoSec(r->start_sec, r->start_msec);
+    auto end = toNanoSec(now->sec, now->msec);
+
+    StrView override;
+
+    auto ctx = getOtelCtx(r);
+    if (!ctx || !ctx->current.sampled) {
+        override = getTraceOverride(r, end - start);
+        if (override.empty()) {
+            ctx = NULL;
+        } else {
+            bool created = ctx == NULL;
+
+            ctx = ensureOtelCtx(r);
+            if (!ctx) {
+                return NGX_ERROR;
+            }
+
+            // recorded after all, as are spans, logs and exemplars below
+            ctx->current.sampled = true;
+
+            // nothing was injected, so the last location decides
+            if (created && getLocationConf(r)->upstreamSpans) {
+                ctx->upstreamSpanId =
+                    TraceContext::generate(true, ctx->current).spanId;
+            }
+        }
+    }
+
+    try {
+        updateMetrics(r, end, end - start, ctx ? &ctx->current : NULL);
+
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "OTel failed to update metrics: %s", e.what());
+        return NGX_ERROR;
+    }
+
+    if (!ctx) {
+        return NGX_DECLINED;
+    }
+
+    try {
+        BatchExporter::SpanInfo info{
+            getSpanName(r), ctx->current, ctx->parent.spanId, start, end};
+
+        info.priority = isPrioritySpan(r, end - start);
+
+        auto fillSpan = [r, ctx, override](BatchExporter::Span& span) {
+            addDefaultAttrs(span, r);
+            addCustomAttrs(span, r);
+
+            if (ctx->samplingProbability > 0) {
+                span.addDouble("nginx.sampling.probability",
+                    ctx->samplingProbability);
+            }
+
+            // tells tail-sampled spans from head-sampled ones
+            if (!override.empty()) {
+                span.add("nginx.sampling.override", override);
+            }
+
+            for (int i = 0; i < PhaseEvent::Count; i++) {
+                if (ctx->phaseTimes[i]) {
+                    span.addEvent(PhaseEvent::Names[i],
+                        ctx->phaseTimes[i] * 1000000);
+                }
+            }
+        };
+
+        bool ok = addSpan(info, fillSpan);
+
+        if (ok && ctx->upstreamSpanId.IsValid()) {
+            ok = addUpstreamSpans(r, ctx, start, end, info.priority);
+        }
+
+        if (!ok) {
+            static size_t dropped = 0;
+            static time_t lastLog = 0;
+            ++dropped;
+            if (lastLog != ngx_time()) {
+                lastLog = ngx_time();
+                ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                    "OTel dropped records: %uz", dropped);
+            }
+        }
+
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "OTel failed to add span: %s", e.what());
+        return NGX_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+ngx_int_t initMetricsZone(ngx_shm_zone_t* zone, void* data)
+{
+    // values are cumulative, so they are kept across reloads
+    if (data) {
+        zone->data = data;
+        return NGX_OK;
+    }
+
+    auto shpool = (ngx_slab_pool_t*)zone->shm.addr;
+
+    auto size = shpool->pfree * ngx_pagesize;
+    auto mem = ngx_slab_calloc(shpool, size);
+    if (mem == NULL) {
+        return NGX_ERROR;
+    }
+
+    auto tp = ngx_timeofday();
+
+    zone->data = RedMetrics::create(mem, size,
+        ((uint64_t)tp->sec * 1000 + tp->msec) * 1000000);
+
+    return NGX_OK;
+}
+
+ngx_int_t initRateZone(ngx_shm_zone_t* zone, void* data)
+{
+    auto mcf = (MainConf*)zone->data;
+    auto shpool = (ngx_slab_pool_t*)zone->shm.addr;
+
+    // Buckets are never freed, as workers of previous configurations may
+    // still take tokens from them. Those of removed locations are kept to be
+    // picked up again until the zone is recreated.
+    auto list = data ? (RateNode*)shpool->data : NULL;
+
+    for (auto limit : mcf->rateLimits) {
+        auto node = list;
+        while (node && (node->keyLen != limit->key.len ||
+                ngx_memcmp(node->key, limit->key.data, limit->key.len))) {
+            node = node->next;
+        }
+
+        if (node == NULL) {
+            node = (RateNode*)ngx_slab_alloc(shpool,
+                offsetof(RateNode, key) + limit->key.len);
+            auto mem = ngx_slab_alloc(shpool, sizeof(TokenBucket));
+
+            if (node == NULL || mem == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, zone->shm.log, 0,
+                    "\"%V\" zone is full, restart to drop buckets of "
+                    "removed locations", &zone->shm.name);
+                return NGX_ERROR;
+            }
+
+            node->bucket = TokenBucket::create(mem);
+            node->keyLen = limit->key.len;
+            ngx_memcpy(node->key, limit->key.data, limit->key.len);
+
+            node->next = list;
+            list = node;
+        }
+
+        limit->bucket = node->bucket;
+    }
+
+    shpool->data = list;
+    zone->data = list;
+
+    return NGX_OK;
+}
+
+ngx_int_t initModule(ngx_conf_t* cf)
+{
+    for (auto& header : Propagation::Headers) {
+        header.hash = ngx_hash_key((u_char*)header.name.data(),
+            header.name.size());
+    }
+
+    auto cmcf = (ngx_http_core_main_conf_t*)ngx_http_conf_get_module_main_conf(
+        cf, ngx_http_core_module);
+
+    auto h = (ngx_http_handler_pt*)ngx_array_push(
+        &cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = onRequestStart;
+
+    h = (ngx_http_handler_pt*)ngx_array_push(
+        &cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = onRequestEnd;
+
+    auto mcf = getMainConf(cf);
+
+    if (mcf->metrics) {
+        static ngx_str_t name = ngx_string("otel_metrics");
+
+        mcf->metricsZone = ngx_shared_memory_add(cf, &name,
+            mcf->metricsZoneSize, &gHttpModule);
+        if (mcf->metricsZone == NULL) {
+            return NGX_ERROR;
+        }
+
+        mcf->metricsZone->init = initMetricsZone;
+    }
+
+    if (!mcf->rateLimits.empty()) {
+        static ngx_str_t name = ngx_string("otel_rate_limit");
+
+        // Fixed size, so the zone and its buckets are reused on reload
+        // whatever locations are changed.
+        mcf->rateZone = ngx_shared_memory_add(cf, &name, RateZoneSize,
+            &gHttpModule);
+        if (mcf->rateZone == NULL) {
+            return NGX_ERROR;
+        }
+
+        mcf->rateZone->init = initRateZone;
+        mcf->rateZone->data = mcf;
+    }
+
+    if (mcf->phaseEvents) {
+        h = (ngx_http_handler_pt*)ngx_array_push(
+            &cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        *h = onAccessPhase;
+
+        h = (ngx_http_handler_pt*)ngx_array_push(
+            &cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
 
-    span.add("net.host.name", getServerName(r));
+        *h = onPrecontentPhase;
 
-    if (ngx_connection_local_sockaddr(r->connection, NULL, 0) == NGX_OK) {
-        auto port = ngx_inet_get_port(r->connection->local_sockaddr);
-        auto defaultPort = r->connection->ssl ? 443 : 80;
+        gNextRequestBodyFilter = ngx_http_top_request_body_filter;
+        ngx_http_top_request_body_filter = requestBodyFilter;
 
-        if (port != defaultPort) {
-            span.add("net.host.port", port);
-        }
+        gNextHeaderFilter = ngx_http_top_header_filter;
+        ngx_http_top_header_filter = headerFilter;
+
+        gNextBodyFilter = ngx_http_top_body_filter;
+        ngx_http_top_body_filter = bodyFilter;
     }
 
-    span.add("net.sock.peer.addr", toStrView(r->connection->addr_text));
-    span.add("net.sock.peer.port", ngx_inet_get_port(r->connection->sockaddr));
+    initGrpcLog();
+
+    return NGX_OK;
 }
 
-StrView getSpanName(ngx_http_request_t* r)
+void drainSpanRing()
 {
-    auto lcf = getLocationConf(r);
+    if (!gSpanRingOwner) {
+        gSpanRingOwner = gSpanRing->lock(ngx_pid);
 
-    if (lcf->spanName) {
-        ngx_str_t result;
-        if (ngx_http_complex_value(r, lcf->spanName, &result) != NGX_OK) {
-            throw std::runtime_error("failed to compute complex value");
+        // previous exporter is still running, e.g. after reload
+        if (!gSpanRingOwner) {
+            return;
         }
-
-        return toStrView(result);
-    } else {
-        auto clcf = (ngx_http_core_loc_conf_t*)
-            ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-
-        return toStrView(clcf->name);
     }
+
+    gSpanRing->drain([](StrView span) {
+        return gExporter->addEncoded(span);
+    });
 }
 
-void addCustomAttrs(BatchExporter::Span& span, ngx_http_request_t* r)
+ngx_msec_t flushInterval()
 {
-    auto lcf = getLocationConf(r);
-    auto attrs = (SpanAttr*)lcf->spanAttrs.elts;
+    if (gBatchTuner) {
+        return gBatchTuner->tick();
+    }
 
-    for (ngx_uint_t i = 0; i < lcf->spanAttrs.nelts; i++) {
-        ngx_str_t value;
-        if (ngx_http_complex_value(r, &attrs[i].value, &value) != NGX_OK) {
-            throw std::runtime_error("failed to compute complex value");
-        }
+    return getMainConf((ngx_cycle_t*)ngx_cycle)->interval;
+}
 
-        StrView name = toStrView(attrs[i].name);
-        if (startsWith(name, "http.request.header.") ||
-            startsWith(name, "http.response.header."))
-        {
-            //TODO: remove this once headers are supported natively
-            span.addArray(name, toStrView(value));
-        } else {
-            span.add(name, toStrView(value));
-        }
+std::unique_ptr<ExportClient> createClient(ngx_cycle_t* cycle, MainConf* mcf,
+    Signal signal)
+{
+    Target target;
+    target.endpoint = std::string(toStrView(mcf->endpoint));
+    target.ssl = mcf->ssl;
+    target.trustedCert = mcf->trustedCert;
+    target.headers = mcf->headers;
+    target.compression = (grpc_compression_algorithm)mcf->compression;
+    target.channels = mcf->channels;
+    target.maxInFlight = mcf->maxInFlight;
+
+    std::unique_ptr<ExportClient> client;
+    if (mcf->protocol == Protocol::Http) {
+        client.reset(new HttpExportClient(target, mcf->httpUrl, cycle->log,
+            signal));
+    } else {
+        client.reset(new TraceServiceClient(target, signal));
     }
+
+    return client;
 }
 
-ngx_int_t onRequestEnd(ngx_http_request_t* r)
+ngx_int_t initMetrics(ngx_cycle_t* cycle, MainConf* mcf)
 {
-    auto ctx = getOtelCtx(r);
-    if (!ctx || !ctx->current.sampled) {
-        return NGX_DECLINED;
+    gRedMetrics = (RedMetrics*)mcf->metricsZone->data;
+    gMetricsPool = (ngx_slab_pool_t*)mcf->metricsZone->shm.addr;
+    gMetricsExemplars = mcf->metricsExemplars;
+
+    // the first worker exports metrics of all workers
+    if (ngx_worker != 0) {
+        return NGX_OK;
     }
 
-    auto now = ngx_timeofday();
+    try {
+        gMetricsExporter.reset(new MetricsExporter(
+            createClient(cycle, mcf, Signal::Metrics),
+            mcf->resourceAttrs,
+            mcf->metricsExemplars));
 
-    auto toNanoSec = [](time_t sec, ngx_msec_t msec) -> uint64_t {
-        return (sec * 1000 + msec) * 1000000;
-    };
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
+            "OTel worker init error: %s", e.what());
+        return NGX_ERROR;
+    }
 
-    try {
-        BatchExporter::SpanInfo info{
-            getSpanName(r), ctx->current, ctx->parent.spanId,
-            toNanoSec(r->start_sec, r->start_msec),
-            toNanoSec(now->sec, now->msec)};
+    static ngx_connection_t dummy;
+    static ngx_event_t exportEvent;
 
-        bool ok = gExporter->add(info, [r](BatchExporter::Span& span) {
-            addDefaultAttrs(span, r);
-            addCustomAttrs(span, r);
-        });
+    exportEvent.data = &dummy;
+    exportEvent.log = cycle->log;
+    exportEvent.cancelable = 1;
+    exportEvent.handler = [](ngx_event_t* ev) {
+        auto tp = ngx_timeofday();
 
-        if (!ok) {
-            static size_t dropped = 0;
-            static time_t lastLog = 0;
-            ++dropped;
-            if (lastLog != ngx_time()) {
-                lastLog = ngx_time();
-                ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                    "OTel dropped records: %uz", dropped);
-            }
+        try {
+            gMetricsExporter->send(*gRedMetrics,
+                ((uint64_t)tp->sec * 1000 + tp->msec) * 1000000);
+        } catch (const std::exception& e) {
+            ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
+                "OTel metrics export error: %s", e.what());
         }
 
-    } catch (const std::exception& e) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "OTel failed to add span: %s", e.what());
-        return NGX_ERROR;
-    }
+        ngx_add_timer(ev,
+            getMainConf((ngx_cycle_t*)ngx_cycle)->metricsInterval);
+    };
 
-    return NGX_DECLINED;
+    ngx_add_timer(&exportEvent, mcf->metricsInterval);
+
+    return NGX_OK;
 }
 
-ngx_int_t initModule(ngx_conf_t* cf)
+ngx_int_t initLogs(ngx_cycle_t* cycle, MainConf* mcf)
 {
-    auto cmcf = (ngx_http_core_main_conf_t*)ngx_http_conf_get_module_main_conf(
-        cf, ngx_http_core_module);
+    try {
+        gLogExporter.reset(new BatchExporter(
+            createClient(cycle, mcf, Signal::Logs),
+            mcf->batchSize,
+            mcf->batchCount,
+            mcf->resourceAttrs,
+            nullptr,
+            Signal::Logs));
 
-    auto h = (ngx_http_handler_pt*)ngx_array_push(
-        &cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
-    if (h == NULL) {
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
+            "OTel worker init error: %s", e.what());
         return NGX_ERROR;
     }
 
-    *h = onRequestStart;
+    for (auto head : mcf->logChains) {
+        auto log = head;
+        while (log && log->writer != writeLog) {
+            log = log->next;
+        }
 
-    h = (ngx_http_handler_pt*)ngx_array_push(
-        &cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
-    if (h == NULL) {
-        return NGX_ERROR;
+        // chain is shared with other locations
+        if (log) {
+            continue;
+        }
+
+        log = (ngx_log_t*)ngx_pcalloc(cycle->pool, sizeof(ngx_log_t));
+        if (log == NULL) {
+            return NGX_ERROR;
+        }
+
+        // Chain is sorted by level and the head has the highest one, so
+        // the writer is reached for any line passed to the log handler.
+        log->log_level = head->log_level;
+        log->writer = writeLog;
+
+        log->next = head->next;
+        head->next = log;
     }
 
-    *h = onRequestEnd;
+    static ngx_connection_t dummy;
+    static ngx_event_t flushEvent;
 
-    initGrpcLog();
+    flushEvent.data = &dummy;
+    flushEvent.log = cycle->log;
+    flushEvent.cancelable = 1;
+    flushEvent.handler = [](ngx_event_t* ev) {
+        try {
+            gLogExporter->flush();
+        } catch (const std::exception& e) {
+            ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
+                "OTel flush error: %s", e.what());
+        }
+
+        ngx_add_timer(ev, getMainConf((ngx_cycle_t*)ngx_cycle)->interval);
+    };
+
+    ngx_add_timer(&flushEvent, mcf->interval);
 
     return NGX_OK;
 }
 
 ngx_int_t initWorkerProcess(ngx_cycle_t* cycle)
 {
+    // forked from master with the same state
+    IdGenerator::seed();
+
     auto mcf = getMainConf(cycle);
 
     // no 'http' or 'otel_exporter' blocks
@@ -581,18 +1877,62 @@ ngx_int_t initWorkerProcess(ngx_cycle_t* cycle)
         return NGX_OK;
     }
 
+    // helpers, like cache manager, handle no requests
+    bool worker = ngx_process == NGX_PROCESS_WORKER ||
+        ngx_process == NGX_PROCESS_SINGLE;
+
+    if (worker && mcf->metricsZone && initMetrics(cycle, mcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (worker && !mcf->logChains.empty() && initLogs(cycle, mcf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (mcf->sharedZone) {
+        gSpanRing = (SpanRing*)mcf->sharedZone->data;
+
+        // The first worker exports spans for the others, or the only
+        // process with "master_process off". Helpers, like cache manager,
+        // export none.
+        if (ngx_process == NGX_PROCESS_HELPER || ngx_worker != 0) {
+            return NGX_OK;
+        }
+    }
+
     try {
-        Target target;
-        target.endpoint = std::string(toStrView(mcf->endpoint));
-        target.ssl = mcf->ssl;
-        target.trustedCert = mcf->trustedCert;
-        target.headers = mcf->headers;
+        auto client = createClient(cycle, mcf, Signal::Traces);
+
+        // spans are still exported if spill is unavailable
+        std::unique_ptr<SpillQueue> spill;
+        if (mcf->spillDir.len) {
+            try {
+                spill.reset(new SpillQueue(
+                    std::string(toStrView(mcf->spillDir)),
+                    mcf->spillSize));
+            } catch (const std::exception& e) {
+                ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
+                    "OTel failed to open spill: %s", e.what());
+            }
+        }
 
         gExporter.reset(new BatchExporter(
-            target,
+            std::move(client),
             mcf->batchSize,
             mcf->batchCount,
-            mcf->resourceAttrs));
+            mcf->resourceAttrs,
+            std::move(spill)));
+
+        gExporter->setPriorityReserve(mcf->priorityReserve);
+
+        if (mcf->adaptive) {
+            gBatchTuner.reset(new BatchTuner(
+                mcf->minBatchSize, mcf->batchSize,
+                mcf->minInterval, mcf->interval));
+
+            gExporter->setBatchSize(gBatchTuner->batchSize());
+        }
     } catch (const std::exception& e) {
         ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
             "OTel worker init error: %s", e.what());
@@ -604,41 +1944,159 @@ ngx_int_t initWorkerProcess(ngx_cycle_t* cycle)
 
     flushEvent.data = &dummy;
     flushEvent.log = cycle->log;
-    flushEvent.cancelable = 1;
+    // keep exiting worker till the last export on its event loop
+    flushEvent.cancelable = mcf->protocol != Protocol::Http;
     flushEvent.handler = [](ngx_event_t* ev) {
+        bool exiting = ngx_exiting && !ev->cancelable;
+
         try {
-            gExporter->flush();
+            if (exiting && gSpanRing) {
+                drainSpanRing();
+            }
+
+            if (exiting || !gBatchTuner ||
+                gBatchTuner->update(*gExporter, ngx_current_msec))
+            {
+                gExporter->flush();
+            }
         } catch (const std::exception& e) {
             ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
                 "OTel flush error: %s", e.what());
         }
 
-        auto mcf = getMainConf((ngx_cycle_t*)ngx_cycle);
+        // Requests still processed or exported keep their timers. Once none
+        // is left, spans are all sent and the worker exits.
+        if (exiting) {
+            if (ngx_event_no_timers_left() != NGX_OK) {
+                ngx_add_timer(ev, ExitFlushInterval);
+            }
+            return;
+        }
 
-        ngx_add_timer(ev, mcf->interval);
+        ngx_add_timer(ev, flushInterval());
     };
 
-    ngx_add_timer(&flushEvent, mcf->interval);
+    ngx_add_timer(&flushEvent, flushInterval());
+
+    if (gSpanRing) {
+        static ngx_event_t drainEvent;
+
+        drainEvent.data = &dummy;
+        drainEvent.log = cycle->log;
+        drainEvent.cancelable = 1;
+        drainEvent.handler = [](ngx_event_t* ev) {
+            try {
+                drainSpanRing();
+            } catch (const std::exception& e) {
+                ngx_log_error(NGX_LOG_CRIT, ev->log, 0,
+                    "OTel drain error: %s", e.what());
+            }
+
+            auto mcf = getMainConf((ngx_cycle_t*)ngx_cycle);
+
+            ngx_add_timer(ev, std::min(mcf->interval, MaxDrainInterval));
+        };
+
+        ngx_add_timer(&drainEvent, std::min(mcf->interval, MaxDrainInterval));
+    }
 
     return NGX_OK;
 }
 
 void exitWorkerProcess(ngx_cycle_t* cycle)
 {
+    // values left are exported by the next worker from the same zone
+    gMetricsExporter.reset();
+
+    for (auto& item : gMetricsCells) {
+        if (item.second) {
+            RedMetrics::releaseCell(item.second);
+        }
+    }
+
+    gMetricsCells.clear();
+
+    if (gLogExporter) {
+        try {
+            gLogExporter->flush();
+        } catch (const std::exception& e) {
+            ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
+                "OTel flush error: %s", e.what());
+        }
+
+        gLogExporter.reset();
+    }
+
     if (!gExporter) {
         return;
     }
 
     try {
+        if (gSpanRing) {
+            drainSpanRing();
+        }
+
         gExporter->flush();
     } catch (const std::exception& e) {
         ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
             "OTel flush error: %s", e.what());
     }
 
+    if (gSpanRingOwner) {
+        gSpanRing->unlock(ngx_pid);
+    }
+
+    gBatchTuner.reset();
     gExporter.reset();
 }
 
+char* initHttpExporter(ngx_conf_t* cf, MainConf* mcf)
+{
+    if (mcf->ssl) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"otel_exporter\" does not support https with \"protocol http\"");
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (mcf->compression != NGX_CONF_UNSET_UINT &&
+            mcf->compression != GRPC_COMPRESS_NONE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"otel_exporter\" does not support \"compression\" "
+            "with \"protocol http\"");
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    // requests are sent one by one
+    if (mcf->channels != NGX_CONF_UNSET_SIZE && mcf->channels != 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"otel_exporter\" does not support \"channels\" "
+            "with \"protocol http\"");
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    auto& u = mcf->httpUrl;
+
+    u.url = mcf->endpoint;
+    u.default_port = 4318;
+    u.uri_part = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "%s in \"otel_exporter\" endpoint \"%V\"", u.err, &u.url);
+        }
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (u.naddrs == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "no addresses for \"otel_exporter\" endpoint \"%V\"", &u.url);
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
 char* setExporter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
     auto mcf = getMainConf(cf);
@@ -703,6 +2161,22 @@ char* setExporter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
         return (char*)NGX_CONF_ERROR;
     }
 
+    if (mcf->channels == 0 || mcf->maxInFlight == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"otel_exporter\" requires non-zero \"channels\" "
+            "and \"max_in_flight\"");
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (mcf->spillDir.len &&
+            ngx_conf_full_name(cf->cycle, &mcf->spillDir, 0) != NGX_OK) {
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (mcf->protocol == Protocol::Http) {
+        return initHttpExporter(cf, mcf);
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -758,26 +2232,78 @@ char* addExporterHeader(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
     auto args = (ngx_str_t*)cf->args->elts;
 
-    // don't force on users lower case name requirement of gRPC
-    ngx_strlow(args[1].data, args[1].data, args[1].len);
+    // don't force on users lower case name requirement of gRPC
+    ngx_strlow(args[1].data, args[1].data, args[1].len);
+
+    try {
+        // validate header here to avoid runtime assert failure in gRPC
+        auto name = toStrView(args[1]);
+        if (!Target::validateHeaderName(name)) {
+            return (char*)"has invalid header name";
+        }
+        auto value = toStrView(args[2]);
+        if (!Target::validateHeaderValue(value)) {
+            return (char*)"has invalid header value";
+        }
+
+        getMainConf(cf)->headers.emplace_back(name, value);
+    } catch (const std::exception& e) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "OTel: %s", e.what());
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t initSharedZone(ngx_shm_zone_t* zone, void* data)
+{
+    // keep spans queued before reload
+    if (data) {
+        zone->data = data;
+        return NGX_OK;
+    }
+
+    auto shpool = (ngx_slab_pool_t*)zone->shm.addr;
+
+    auto size = shpool->pfree * ngx_pagesize;
+    auto mem = ngx_slab_alloc(shpool, size);
+    if (mem == NULL) {
+        return NGX_ERROR;
+    }
+
+    zone->data = SpanRing::create(mem, size);
+
+    return NGX_OK;
+}
+
+char* setSharedZone(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    auto mcf = getMainConf(cf);
+
+    if (mcf->sharedZone) {
+        return (char*)"is duplicate";
+    }
+
+    auto value = ((ngx_str_t*)cf->args->elts)[1];
 
-    try {
-        // validate header here to avoid runtime assert failure in gRPC
-        auto name = toStrView(args[1]);
-        if (!Target::validateHeaderName(name)) {
-            return (char*)"has invalid header name";
-        }
-        auto value = toStrView(args[2]);
-        if (!Target::validateHeaderValue(value)) {
-            return (char*)"has invalid header value";
-        }
+    auto size = ngx_parse_size(&value);
+    if (size == NGX_ERROR) {
+        return (char*)"has invalid size";
+    }
 
-        getMainConf(cf)->headers.emplace_back(name, value);
-    } catch (const std::exception& e) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "OTel: %s", e.what());
+    if (size < (ssize_t)(8 * ngx_pagesize)) {
+        return (char*)"is too small";
+    }
+
+    static ngx_str_t name = ngx_string("otel_exporter");
+
+    mcf->sharedZone = ngx_shared_memory_add(cf, &name, size, &gHttpModule);
+    if (mcf->sharedZone == NULL) {
         return (char*)NGX_CONF_ERROR;
     }
 
+    mcf->sharedZone->init = initSharedZone;
+
     return NGX_CONF_OK;
 }
 
@@ -803,6 +2329,18 @@ void* createMainConf(ngx_conf_t* cf)
     mcf->interval = NGX_CONF_UNSET_MSEC;
     mcf->batchSize = NGX_CONF_UNSET_SIZE;
     mcf->batchCount = NGX_CONF_UNSET_SIZE;
+    mcf->compression = NGX_CONF_UNSET_UINT;
+    mcf->protocol = NGX_CONF_UNSET_UINT;
+    mcf->channels = NGX_CONF_UNSET_SIZE;
+    mcf->maxInFlight = NGX_CONF_UNSET_SIZE;
+    mcf->spillSize = NGX_CONF_UNSET_SIZE;
+    mcf->adaptive = NGX_CONF_UNSET;
+    mcf->minBatchSize = NGX_CONF_UNSET_SIZE;
+    mcf->minInterval = NGX_CONF_UNSET_MSEC;
+    mcf->priorityReserve = NGX_CONF_UNSET_SIZE;
+    mcf->metricsInterval = NGX_CONF_UNSET_MSEC;
+    mcf->metricsZoneSize = NGX_CONF_UNSET_SIZE;
+    mcf->metricsExemplars = NGX_CONF_UNSET;
 
     return static_cast<MainConfBase*>(mcf);
 }
@@ -814,6 +2352,28 @@ char* initMainConf(ngx_conf_t* cf, void* conf)
     ngx_conf_init_msec_value(mcf->interval, 5000);
     ngx_conf_init_size_value(mcf->batchSize, 512);
     ngx_conf_init_size_value(mcf->batchCount, 4);
+    ngx_conf_init_uint_value(mcf->compression, GRPC_COMPRESS_NONE);
+    ngx_conf_init_uint_value(mcf->protocol, Protocol::Grpc);
+    ngx_conf_init_size_value(mcf->channels, 1);
+    ngx_conf_init_size_value(mcf->maxInFlight, mcf->batchCount);
+    ngx_conf_init_size_value(mcf->spillSize, 64 * 1024 * 1024);
+    ngx_conf_init_value(mcf->adaptive, 0);
+    ngx_conf_init_size_value(mcf->minBatchSize,
+        std::max(mcf->batchSize / 8, (size_t)1));
+    ngx_conf_init_msec_value(mcf->minInterval,
+        std::min(mcf->interval, (ngx_msec_t)100));
+    ngx_conf_init_size_value(mcf->priorityReserve, 0);
+    ngx_conf_init_msec_value(mcf->metricsInterval, 10000);
+    ngx_conf_init_size_value(mcf->metricsZoneSize, 1024 * 1024);
+    ngx_conf_init_value(mcf->metricsExemplars, 0);
+
+    if (mcf->minBatchSize == 0 || mcf->minBatchSize > mcf->batchSize ||
+            mcf->minInterval > mcf->interval) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"otel_exporter\" requires \"min_batch_size\" and "
+            "\"min_interval\" within \"batch_size\" and \"interval\"");
+        return (char*)NGX_CONF_ERROR;
+    }
 
     try {
         if (mcf->serviceName.data == NULL) {
@@ -829,6 +2389,223 @@ char* initMainConf(ngx_conf_t* cf, void* conf)
     return NGX_CONF_OK;
 }
 
+char* setTraceOverride(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    auto lcf = (LocationConf*)conf;
+
+    if (lcf->traceOnError != NGX_CONF_UNSET) {
+        return (char*)"is duplicate";
+    }
+
+    lcf->traceOnError = 0;
+
+    auto args = (ngx_str_t*)cf->args->elts;
+
+    if (cf->args->nelts == 2 && toStrView(args[1]) == "off") {
+        return NGX_CONF_OK;
+    }
+
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        auto arg = toStrView(args[i]);
+
+        if (arg == "error") {
+            lcf->traceOnError = 1;
+            continue;
+        }
+
+        if (startsWith(arg, "latency=")) {
+            ngx_str_t value = {args[i].len - 8, args[i].data + 8};
+
+            lcf->traceLatency = ngx_parse_time(&value, 0);
+            if (lcf->traceLatency == (ngx_msec_t)NGX_ERROR) {
+                return (char*)"has invalid latency";
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &args[i]);
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+// bucket for location being parsed, shared with those of the same key
+RateLimit* addRateLimit(ngx_conf_t* cf, ngx_uint_t rate)
+{
+    auto cmcf = (ngx_http_core_main_conf_t*)
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+    auto cscf = (ngx_http_core_srv_conf_t*)
+        ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+    auto clcf = (ngx_http_core_loc_conf_t*)
+        ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    // server names may be empty or repeat, while the server being parsed
+    // is the last one added
+    ngx_uint_t server = cmcf->servers.nelts - 1;
+
+    ngx_str_t key;
+    key.data = (u_char*)ngx_pnalloc(cf->pool, cscf->server_name.len +
+        clcf->name.len + 3 + 2 * NGX_INT_T_LEN);
+    if (key.data == NULL) {
+        return NULL;
+    }
+
+    key.len = ngx_sprintf(key.data, "%ui:%V:%V:%ui", server,
+        &cscf->server_name, &clcf->name, rate) - key.data;
+
+    auto& limits = getMainConf(cf)->rateLimits;
+
+    for (auto limit : limits) {
+        if (toStrView(limit->key) == toStrView(key)) {
+            return limit;
+        }
+    }
+
+    auto limit = (RateLimit*)ngx_pcalloc(cf->pool, sizeof(RateLimit));
+    if (limit == NULL) {
+        return NULL;
+    }
+
+    limit->key = key;
+    limit->rate = rate;
+
+    limits.push_back(limit);
+
+    return limit;
+}
+
+char* setSampler(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    auto lcf = (LocationConf*)conf;
+
+    if (lcf->sampler != NGX_CONF_UNSET_PTR) {
+        return (char*)"is duplicate";
+    }
+
+    lcf->sampler = NULL;
+    lcf->rateLimit = NULL;
+
+    auto args = (ngx_str_t*)cf->args->elts;
+
+    if (cf->args->nelts == 2 && toStrView(args[1]) == "off") {
+        return NGX_CONF_OK;
+    }
+
+    bool parentBased = false;
+    ngx_int_t ratio = NGX_CONF_UNSET;
+    ngx_int_t rateLimit = NGX_CONF_UNSET;
+
+    for (ngx_uint_t i = 1; i < cf->args->nelts; i++) {
+        auto arg = toStrView(args[i]);
+
+        if (arg == "parent_based") {
+            parentBased = true;
+            continue;
+        }
+
+        if (startsWith(arg, "ratio=")) {
+            ratio = ngx_atofp(args[i].data + 6, args[i].len - 6, 6);
+            if (ratio == NGX_ERROR || ratio > TraceSampler::RatioScale) {
+                return (char*)"has invalid ratio";
+            }
+            continue;
+        }
+
+        if (startsWith(arg, "rate_limit=")) {
+            rateLimit = ngx_atoi(args[i].data + 11, args[i].len - 11);
+            if (rateLimit == NGX_ERROR || rateLimit == 0) {
+                return (char*)"has invalid rate limit";
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &args[i]);
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    // rate limit alone makes no consistent decision to put to tracestate
+    if (parentBased || ratio != NGX_CONF_UNSET ||
+            rateLimit == NGX_CONF_UNSET) {
+        auto mem = ngx_palloc(cf->pool, sizeof(TraceSampler));
+        if (mem == NULL) {
+            return (char*)NGX_CONF_ERROR;
+        }
+
+        lcf->sampler = new (mem) TraceSampler(ratio != NGX_CONF_UNSET ?
+            ratio : TraceSampler::RatioScale, parentBased);
+    }
+
+    if (rateLimit != NGX_CONF_UNSET) {
+        lcf->rateLimit = addRateLimit(cf, rateLimit);
+        if (lcf->rateLimit == NULL) {
+            return (char*)NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+char* setTraceContext(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    auto lcf = (LocationConf*)conf;
+
+    if (lcf->traceContext != NGX_CONF_UNSET_UINT) {
+        return (char*)"is duplicate";
+    }
+
+    auto args = (ngx_str_t*)cf->args->elts;
+
+    for (auto e = Propagation::Types; e->name.len; e++) {
+        if (toStrView(e->name) == toStrView(args[1])) {
+            lcf->traceContext = e->value;
+            break;
+        }
+    }
+
+    if (lcf->traceContext == NGX_CONF_UNSET_UINT) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid value \"%V\"", &args[1]);
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 2) {
+        lcf->contextFormats = Propagation::W3C;
+        lcf->contextOrder = Propagation::W3C;
+        return NGX_CONF_OK;
+    }
+
+    lcf->contextFormats = 0;
+    lcf->contextOrder = 0;
+    int shift = 0;
+
+    for (ngx_uint_t i = 2; i < cf->args->nelts; i++) {
+        auto m = Propagation::Formats;
+
+        while (m->name.len && toStrView(m->name) != toStrView(args[i])) {
+            m++;
+        }
+
+        if (m->name.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "invalid format \"%V\"", &args[i]);
+            return (char*)NGX_CONF_ERROR;
+        }
+
+        if (lcf->contextFormats & m->mask) {
+            continue;
+        }
+
+        lcf->contextFormats |= m->mask;
+        lcf->contextOrder |= m->mask << shift;
+        shift += 4;
+    }
+
+    return NGX_CONF_OK;
+}
+
 char* addSpanAttr(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 {
     auto lcf = (LocationConf*)conf;
@@ -873,7 +2650,7 @@ ngx_int_t hexIdVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
             return NGX_ERROR;
         }
 
-        id->ToLowerBase16({buf, size});
+        encodeHex(id->Id().data(), id->Id().size(), buf);
 
         v->len = size;
         v->valid = 1;
@@ -888,6 +2665,43 @@ ngx_int_t hexIdVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
     return NGX_OK;
 }
 
+ngx_int_t baggageVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
+    uintptr_t data)
+{
+    auto name = toStrView(*(ngx_str_t*)data).substr(
+        sizeof("otel_baggage_") - 1);
+
+    StrView value;
+    if (!Baggage(getHeader(r, "baggage")).find(name, value)) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    auto p = (u_char*)value.data();
+    size_t len = value.size();
+
+    // copy is only made to decode value
+    if (value.find('%') != StrView::npos) {
+        auto src = p;
+        auto dst = (u_char*)ngx_pnalloc(r->pool, len);
+        if (dst == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = dst;
+        ngx_unescape_uri(&dst, &src, len, 0);
+        len = dst - p;
+    }
+
+    v->len = len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 ngx_int_t parentSampledVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
     uintptr_t data)
 {
@@ -905,6 +2719,45 @@ ngx_int_t parentSampledVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
     return NGX_OK;
 }
 
+namespace ExporterVar {
+
+const uintptr_t BatchSize = 0;
+const uintptr_t Interval = 1;
+
+}
+
+// current batch size and flush interval of the exporter in this worker
+ngx_int_t exporterVar(ngx_http_request_t* r, ngx_http_variable_value_t* v,
+    uintptr_t data)
+{
+    if (!gExporter) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    auto mcf = getMainConf((ngx_cycle_t*)ngx_cycle);
+
+    uint64_t value;
+    if (data == ExporterVar::Interval) {
+        value = gBatchTuner ? gBatchTuner->interval() : mcf->interval;
+    } else {
+        value = gBatchTuner ? gBatchTuner->batchSize() : mcf->batchSize;
+    }
+
+    auto buf = (u_char*)ngx_pnalloc(r->pool, NGX_INT64_LEN);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(buf, "%uL", value) - buf;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = buf;
+
+    return NGX_OK;
+}
+
 ngx_int_t addVariables(ngx_conf_t* cf)
 {
     using namespace opentelemetry::trace;
@@ -919,11 +2772,20 @@ ngx_int_t addVariables(ngx_conf_t* cf)
         { ngx_string("otel_parent_id"), NULL, hexIdVar<SpanId>,
             offsetof(OtelCtx, parent.spanId) },
 
-        { ngx_string("otel_parent_sampled"), NULL, parentSampledVar }
+        { ngx_string("otel_parent_sampled"), NULL, parentSampledVar },
+
+        { ngx_string("otel_baggage_"), NULL, baggageVar, 0,
+            NGX_HTTP_VAR_PREFIX },
+
+        { ngx_string("otel_batch_size"), NULL, exporterVar,
+            ExporterVar::BatchSize },
+
+        { ngx_string("otel_batch_interval"), NULL, exporterVar,
+            ExporterVar::Interval }
     };
 
     for (auto& v : vars) {
-        auto var = ngx_http_add_variable(cf, &v.name, 0);
+        auto var = ngx_http_add_variable(cf, &v.name, v.flags);
         if (var == NULL) {
             return NGX_ERROR;
         }
@@ -943,11 +2805,94 @@ void* createLocationConf(ngx_conf_t* cf)
 
     conf->trace = (ngx_http_complex_value_t*)NGX_CONF_UNSET_PTR;
     conf->traceContext = NGX_CONF_UNSET_UINT;
+    conf->contextFormats = NGX_CONF_UNSET_UINT;
+    conf->contextOrder = NGX_CONF_UNSET_UINT;
+    conf->sampler = (TraceSampler*)NGX_CONF_UNSET_PTR;
+    conf->rateLimit = (RateLimit*)NGX_CONF_UNSET_PTR;
     conf->spanName = (ngx_http_complex_value_t*)NGX_CONF_UNSET_PTR;
+    conf->spanPriority = (ngx_http_complex_value_t*)NGX_CONF_UNSET_PTR;
+    conf->priorityLatency = NGX_CONF_UNSET_MSEC;
+    conf->traceOnError = NGX_CONF_UNSET;
+    conf->traceLatency = NGX_CONF_UNSET_MSEC;
+    conf->upstreamSpans = NGX_CONF_UNSET;
+    conf->phaseEvents = NGX_CONF_UNSET;
+    conf->metrics = NGX_CONF_UNSET;
+    conf->logs = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
 
+// Encodes attributes constant for location in advance, so that only
+// request-specific ones are added to each span.
+ngx_int_t compileSpanTemplate(ngx_conf_t* cf, LocationConf* lcf)
+{
+    auto clcf = (ngx_http_core_loc_conf_t*)
+        ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    auto cscf = (ngx_http_core_srv_conf_t*)
+        ngx_http_conf_get_module_srv_conf(cf, ngx_http_core_module);
+
+    auto attrs = (SpanAttr*)lcf->spanAttrs.elts;
+
+    if (ngx_array_init(&lcf->dynamicAttrs, cf->pool,
+            lcf->spanAttrs.nelts ? lcf->spanAttrs.nelts : 1,
+            sizeof(SpanAttr)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (ngx_uint_t i = 0; i < lcf->spanAttrs.nelts; i++) {
+        if (attrs[i].value.lengths == NULL) {
+            continue;
+        }
+
+        auto attr = (SpanAttr*)ngx_array_push(&lcf->dynamicAttrs);
+        if (attr == NULL) {
+            return NGX_ERROR;
+        }
+
+        *attr = attrs[i];
+    }
+
+    try {
+        for (int ssl = 0; ssl < 2; ssl++) {
+            BatchExporter::EncodedAttrs encoded;
+
+            if (clcf->name.len) {
+                encoded.add("http.route", toStrView(clcf->name));
+            }
+
+            encoded.add("http.scheme", ssl ? "https" : "http");
+
+            if (cscf->server_name.len) {
+                encoded.add("net.host.name", toStrView(cscf->server_name));
+            }
+
+            for (ngx_uint_t i = 0; i < lcf->spanAttrs.nelts; i++) {
+                if (attrs[i].value.lengths == NULL) {
+                    addCustomAttr(encoded, toStrView(attrs[i].name),
+                        toStrView(attrs[i].value.value));
+                }
+            }
+
+            auto data = encoded.data();
+
+            auto& tmpl = lcf->spanTemplate[ssl];
+            tmpl.data = (u_char*)ngx_pnalloc(cf->pool, data.size());
+            if (tmpl.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            tmpl.len = data.size();
+            ngx_memcpy(tmpl.data, data.data(), data.size());
+        }
+
+    } catch (const std::exception& e) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "OTel: %s", e.what());
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
 char* mergeLocationConf(ngx_conf_t* cf, void* parent, void* child)
 {
     auto prev = (LocationConf*)parent;
@@ -955,7 +2900,47 @@ char* mergeLocationConf(ngx_conf_t* cf, void* parent, void* child)
 
     ngx_conf_merge_ptr_value(conf->trace, prev->trace, NULL);
     ngx_conf_merge_uint_value(conf->traceContext, prev->traceContext, 0);
+    ngx_conf_merge_uint_value(conf->contextFormats, prev->contextFormats,
+        Propagation::W3C);
+    ngx_conf_merge_uint_value(conf->contextOrder, prev->contextOrder,
+        Propagation::W3C);
+    ngx_conf_merge_ptr_value(conf->sampler, prev->sampler, NULL);
+    ngx_conf_merge_ptr_value(conf->rateLimit, prev->rateLimit, NULL);
     ngx_conf_merge_ptr_value(conf->spanName, prev->spanName, NULL);
+    ngx_conf_merge_ptr_value(conf->spanPriority, prev->spanPriority, NULL);
+    ngx_conf_merge_msec_value(conf->priorityLatency, prev->priorityLatency,
+        NGX_CONF_UNSET_MSEC);
+
+    if (conf->traceOnError == NGX_CONF_UNSET) {
+        conf->traceOnError = prev->traceOnError != NGX_CONF_UNSET ?
+            prev->traceOnError : 0;
+        conf->traceLatency = prev->traceLatency;
+    }
+
+    ngx_conf_merge_value(conf->upstreamSpans, prev->upstreamSpans, 0);
+    ngx_conf_merge_value(conf->phaseEvents, prev->phaseEvents, 0);
+
+    ngx_conf_merge_value(conf->metrics, prev->metrics, 0);
+    ngx_conf_merge_uint_value(conf->logs, prev->logs, 0);
+
+    if (conf->phaseEvents) {
+        getMainConf(cf)->phaseEvents = true;
+    }
+
+    if (conf->metrics) {
+        getMainConf(cf)->metrics = true;
+    }
+
+    if (conf->logs) {
+        auto clcf = (ngx_http_core_loc_conf_t*)
+            ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+        auto& chains = getMainConf(cf)->logChains;
+        if (std::find(chains.begin(), chains.end(), clcf->error_log) ==
+                chains.end()) {
+            chains.push_back(clcf->error_log);
+        }
+    }
 
     if (conf->spanAttrs.elts == NULL) {
         conf->spanAttrs = prev->spanAttrs;
@@ -963,7 +2948,13 @@ char* mergeLocationConf(ngx_conf_t* cf, void* parent, void* child)
 
     auto mcf = getMainConf(cf);
 
-    if (mcf->endpoint.len == 0 && conf->trace) {
+    if (mcf->endpoint.len && compileSpanTemplate(cf, conf) != NGX_OK) {
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    if (mcf->endpoint.len == 0 && (conf->trace || conf->traceOnError ||
+            conf->traceLatency != NGX_CONF_UNSET_MSEC || conf->metrics ||
+            conf->logs)) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
             "\"otel_exporter\" block is missing");
         return (char*)NGX_CONF_ERROR;
@@ -1002,3 +2993,20 @@ ngx_module_t gHttpModule = {
     NULL,                               /* exit master */
     NGX_MODULE_V1_PADDING
 };
+
+bool hasSharedExporter(ngx_cycle_t* cycle)
+{
+    auto mcf = getMainConf(cycle);
+
+    return mcf && mcf->endpoint.len;
+}
+
+bool addSharedSpan(const BatchExporter::SpanInfo& info,
+    const std::function<void (BatchExporter::Span&)>& fillSpan)
+{
+    if (!gExporter && !gSpanRing) {
+        return false;
+    }
+
+    return addSpan(info, fillSpan);
+}
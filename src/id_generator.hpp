@@ -0,0 +1,106 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+// Fast non-cryptographic generator of trace and span IDs (xoshiro256**),
+// as the SDK one is costly to set up for each request. State is not shared
+// between threads. Forked workers would repeat IDs of each other, so each
+// one must seed it from the kernel on start.
+class IdGenerator {
+public:
+    static void seed()
+    {
+        auto& s = state();
+
+        s.seeded = false;
+
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            auto n = read(fd, s.word, sizeof(s.word));
+            close(fd);
+
+            if (n == sizeof(s.word)) {
+                s.seeded = true;
+            }
+        }
+
+        if (!s.seeded) {
+            std::random_device rd;
+
+            for (auto& w : s.word) {
+                w = (uint64_t)rd() << 32 | rd();
+            }
+
+            s.seeded = true;
+        }
+
+        // all-zero state is the only invalid one
+        if ((s.word[0] | s.word[1] | s.word[2] | s.word[3]) == 0) {
+            s.word[0] = 1;
+        }
+    }
+
+    // fills 'buf' with random non-zero ID
+    template <size_t N>
+    static void generate(uint8_t (&buf)[N])
+    {
+        static_assert(N % 8 == 0, "ID size must be multiple of 8");
+
+        if (!state().seeded) {
+            seed();
+        }
+
+        uint64_t any;
+
+        do {
+            any = 0;
+
+            for (size_t i = 0; i < N; i += 8) {
+                uint64_t r = next();
+                std::memcpy(buf + i, &r, 8);
+                any |= r;
+            }
+
+        } while (any == 0);
+    }
+
+private:
+    struct State {
+        uint64_t word[4];
+        bool seeded;
+    };
+
+    static State& state()
+    {
+        static State s;
+        return s;
+    }
+
+    static uint64_t rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static uint64_t next()
+    {
+        auto& s = state().word;
+
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+};
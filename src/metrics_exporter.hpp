@@ -0,0 +1,281 @@
+#pragma once
+
+#include <nginx.h>
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <tuple>
+
+#include "str_view.hpp"
+#include "proto_writer.hpp"
+#include "export_client.hpp"
+#include "red_metrics.hpp"
+
+// Exports RedMetrics as cumulative OTLP metrics: exponential histogram of
+// request duration and request counter. As values are cumulative, export
+// is skipped while the previous one is in flight and failures aren't
+// retried, the next export has all of their data.
+class MetricsExporter {
+public:
+    MetricsExporter(std::unique_ptr<ExportClient> client,
+            const std::map<StrView, StrView>& resourceAttrs, bool exemplars) :
+        exemplars(exemplars), client(std::move(client))
+    {
+        ProtoWriter out(prefix);
+
+        // ExportMetricsServiceRequest.resource_metrics
+        resourceMetricsPos = out.begin(1);
+
+        // ResourceMetrics.resource
+        auto resourcePos = out.begin(1);
+        for (auto& attr : resourceAttrs) {
+            addAttr(out, 1, attr.first, attr.second);
+        }
+        out.end(resourcePos);
+
+        // ResourceMetrics.scope_metrics
+        scopeMetricsPos = out.begin(2);
+
+        // ScopeMetrics.scope
+        auto scopePos = out.begin(1);
+        out.bytes(1, StrView("nginx"));
+        out.bytes(2, StrView(NGINX_VERSION));
+        out.end(scopePos);
+    }
+
+    ~MetricsExporter()
+    {
+        client.reset();
+    }
+
+    // 'now' is in nanoseconds since epoch
+    void send(const RedMetrics& metrics, uint64_t now)
+    {
+        if (inFlight) {
+            return;
+        }
+
+        std::map<Key, Point> points;
+
+        metrics.forEach([&](const RedMetrics::Cell& cell) {
+            auto& point = points[Key(cell.route(), cell.method(),
+                cell.statusClass())];
+
+            point.add(cell, exemplars);
+        });
+
+        if (points.empty()) {
+            return;
+        }
+
+        encode(points, metrics.getStartTime(), now);
+
+        inFlight = true;
+
+        client->send(
+            [this]() {
+                return StrView(data);
+            },
+            [this](grpc::ByteBuffer, grpc::Status status) {
+                if (!status.ok()) {
+                    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                        "OTel metrics export failure: %s",
+                        status.error_message().c_str());
+                }
+
+                inFlight = false;
+
+                return std::chrono::milliseconds(-1);
+            });
+    }
+
+private:
+    // route, method, status class
+    typedef std::tuple<StrView, StrView, int> Key;
+
+    struct Point {
+        uint64_t count{0};
+        uint64_t sum{0};
+        uint64_t zeroCount{0};
+        uint64_t buckets[RedMetrics::BucketCount]{};
+
+        RedMetrics::Exemplar exemplar;
+        bool hasExemplar{false};
+
+        void add(const RedMetrics::Cell& cell, bool exemplars)
+        {
+            count += cell.getCount();
+            sum += cell.getSum();
+            zeroCount += cell.getZeroCount();
+
+            for (int i = 0; i < RedMetrics::BucketCount; i++) {
+                buckets[i] += cell.getBucket(i);
+            }
+
+            // the latest one of all workers
+            RedMetrics::Exemplar ex;
+            if (exemplars && cell.getExemplar(ex) &&
+                    (!hasExemplar || ex.time > exemplar.time)) {
+                exemplar = ex;
+                hasExemplar = true;
+            }
+        }
+    };
+
+    static const uint64_t AggregationCumulative = 2;
+
+    static uint64_t zigzag(int32_t value)
+    {
+        return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    }
+
+    static uint64_t doubleBits(double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static void addAttr(ProtoWriter& out, uint32_t field, StrView key,
+        StrView value)
+    {
+        // KeyValue
+        auto pos = out.begin(field);
+        out.bytes(1, key);
+        out.header(2, ProtoWriter::fieldSize(value.size()));
+        out.bytes(1, value);                         // string_value
+        out.end(pos);
+    }
+
+    static void addAttrs(ProtoWriter& out, uint32_t field, const Key& key)
+    {
+        static const char* const classes[] = {
+            "", "1xx", "2xx", "3xx", "4xx", "5xx"
+        };
+
+        addAttr(out, field, "http.route", std::get<0>(key));
+        addAttr(out, field, "http.method", std::get<1>(key));
+
+        auto statusClass = std::get<2>(key);
+        if (statusClass > 0 && statusClass <= 5) {
+            addAttr(out, field, "nginx.status_class", classes[statusClass]);
+        }
+    }
+
+    void encode(const std::map<Key, Point>& points, uint64_t start,
+        uint64_t now)
+    {
+        data.assign(prefix);
+
+        ProtoWriter out(data);
+
+        // ScopeMetrics.metrics
+        auto metricPos = out.begin(2);
+        out.bytes(1, StrView("http.server.duration"));   // name
+        out.bytes(3, StrView("ms"));                     // unit
+
+        // Metric.exponential_histogram
+        auto dataPos = out.begin(10);
+        for (auto& point : points) {
+            encodeHistogramPoint(out, point.first, point.second, start, now);
+        }
+        out.varint(2, AggregationCumulative);
+        out.end(dataPos);
+
+        out.end(metricPos);
+
+        metricPos = out.begin(2);
+        out.bytes(1, StrView("nginx.http.requests"));
+        out.bytes(3, StrView("{request}"));
+
+        // Metric.sum
+        dataPos = out.begin(7);
+        for (auto& point : points) {
+            // NumberDataPoint
+            auto pos = out.begin(1);
+            addAttrs(out, 7, point.first);
+            out.fixed64(2, start);                   // start_time_unix_nano
+            out.fixed64(3, now);                     // time_unix_nano
+            out.fixed64(6, point.second.count);      // as_int
+            out.end(pos);
+        }
+        out.varint(2, AggregationCumulative);
+        out.varint(3, 1);                            // is_monotonic
+        out.end(dataPos);
+
+        out.end(metricPos);
+
+        out.end(scopeMetricsPos);
+        out.end(resourceMetricsPos);
+    }
+
+    static void encodeHistogramPoint(ProtoWriter& out, const Key& key,
+        const Point& point, uint64_t start, uint64_t now)
+    {
+        // ExponentialHistogramDataPoint
+        auto pos = out.begin(1);
+
+        addAttrs(out, 1, key);
+        out.fixed64(2, start);                       // start_time_unix_nano
+        out.fixed64(3, now);                         // time_unix_nano
+        out.fixed64(4, point.count);                 // count
+        out.fixed64(5, doubleBits(point.sum));       // sum
+        out.varint(6, zigzag(RedMetrics::Scale));    // scale
+        out.fixed64(7, point.zeroCount);             // zero_count
+
+        int first = 0;
+        int last = RedMetrics::BucketCount - 1;
+
+        while (first <= last && point.buckets[first] == 0) {
+            first++;
+        }
+
+        while (last >= first && point.buckets[last] == 0) {
+            last--;
+        }
+
+        if (first <= last) {
+            // positive
+            auto bucketsPos = out.begin(8);
+            out.varint(1, zigzag(RedMetrics::MinIndex + first)); // offset
+
+            // bucket_counts, packed
+            auto countsPos = out.begin(2);
+            for (int i = first; i <= last; i++) {
+                out.varint(point.buckets[i]);
+            }
+            out.end(countsPos);
+
+            out.end(bucketsPos);
+        }
+
+        if (point.hasExemplar) {
+            auto& ex = point.exemplar;
+
+            // exemplars
+            auto exPos = out.begin(11);
+            out.fixed64(2, ex.time);                 // time_unix_nano
+            out.fixed64(3, doubleBits(ex.value));    // as_double
+            out.bytes(4, StrView((char*)ex.spanId, sizeof(ex.spanId)));
+            out.bytes(5, StrView((char*)ex.traceId, sizeof(ex.traceId)));
+            out.end(exPos);
+        }
+
+        out.end(pos);
+    }
+
+    const bool exemplars;
+
+    std::string prefix;
+    size_t resourceMetricsPos;
+    size_t scopeMetricsPos;
+
+    // request being sent
+    std::string data;
+    std::atomic<bool> inFlight{false};
+
+    // destroyed first, as in-flight request refers to data
+    std::unique_ptr<ExportClient> client;
+};
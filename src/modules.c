@@ -2,13 +2,22 @@
 #include <ngx_core.h>
 
 extern ngx_module_t gHttpModule;
+#ifdef NGX_OTEL_STREAM
+extern ngx_module_t gStreamModule;
+#endif
 
 ngx_module_t* ngx_modules[] = {
     &gHttpModule,
+#ifdef NGX_OTEL_STREAM
+    &gStreamModule,
+#endif
     NULL
 };
 
 char* ngx_module_names[] = {
     "ngx_http_otel_module",
+#ifdef NGX_OTEL_STREAM
+    "ngx_stream_otel_module",
+#endif
     NULL
 };
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+
+#include "str_view.hpp"
+
+// Iterates over fields of protobuf message in wire format, for the few
+// small messages that are cheaper to scan than to parse with generated code.
+class ProtoReader {
+public:
+    explicit ProtoReader(StrView data) :
+        p(data.data()), last(data.data() + data.size()) {}
+
+    // Reads next field. Fails at the end of data or if it's malformed.
+    bool next()
+    {
+        uint64_t tag;
+        if (!readVarint(tag)) {
+            return false;
+        }
+
+        fieldNum = tag >> 3;
+
+        switch (tag & 7) {
+        case Varint:
+            return readVarint(value);
+
+        case Fixed64:
+            return skip(8);
+
+        case Len: {
+            uint64_t len;
+            if (!readVarint(len) || len > (uint64_t)(last - p)) {
+                return false;
+            }
+            data = StrView(p, len);
+            p += len;
+            return true;
+        }
+
+        case Fixed32:
+            return skip(4);
+
+        default:
+            return false;
+        }
+    }
+
+    uint32_t field() const
+    {
+        return fieldNum;
+    }
+
+    // value of varint field
+    uint64_t varint() const
+    {
+        return value;
+    }
+
+    // value of length-delimited field
+    StrView bytes() const
+    {
+        return data;
+    }
+
+private:
+    enum WireType {
+        Varint = 0,
+        Fixed64 = 1,
+        Len = 2,
+        Fixed32 = 5
+    };
+
+    bool readVarint(uint64_t& out)
+    {
+        out = 0;
+        for (int shift = 0; shift < 64 && p < last; shift += 7) {
+            uint8_t b = *p++;
+            out |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool skip(size_t n)
+    {
+        if (n > (size_t)(last - p)) {
+            return false;
+        }
+        p += n;
+        return true;
+    }
+
+    const char* p;
+    const char* last;
+
+    uint32_t fieldNum{0};
+    uint64_t value{0};
+    StrView data;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include "str_view.hpp"
+
+// Appends protobuf wire format to a buffer, for messages that are cheaper
+// to encode directly than to build with generated classes.
+class ProtoWriter {
+public:
+    explicit ProtoWriter(std::string& buf) : buf(buf) {}
+
+    static size_t varintSize(uint64_t value)
+    {
+        size_t size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            ++size;
+        }
+        return size;
+    }
+
+    // size of length-delimited field with 1-byte tag
+    static size_t fieldSize(size_t len)
+    {
+        return 1 + varintSize(len) + len;
+    }
+
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80) {
+            buf.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        buf.push_back((char)value);
+    }
+
+    void varint(uint32_t field, uint64_t value)
+    {
+        tag(field, Varint);
+        varint(value);
+    }
+
+    void fixed64(uint32_t field, uint64_t value)
+    {
+        tag(field, Fixed64);
+
+        char bytes[8];
+        for (auto& b : bytes) {
+            b = (char)value;
+            value >>= 8;
+        }
+        buf.append(bytes, sizeof(bytes));
+    }
+
+    void fixed32(uint32_t field, uint32_t value)
+    {
+        tag(field, Fixed32);
+
+        char bytes[4];
+        for (auto& b : bytes) {
+            b = (char)value;
+            value >>= 8;
+        }
+        buf.append(bytes, sizeof(bytes));
+    }
+
+    template <class ByteRange>
+    void bytes(uint32_t field, const ByteRange& range)
+    {
+        header(field, range.size());
+        buf.append((const char*)range.data(), range.size());
+    }
+
+    // appends data already in wire format
+    void raw(StrView data)
+    {
+        buf.append(data.data(), data.size());
+    }
+
+    // starts message or other length-delimited field of known size
+    void header(uint32_t field, size_t len)
+    {
+        tag(field, Len);
+        varint(len);
+    }
+
+    // starts message of unknown size, returns its position for end()
+    size_t begin(uint32_t field)
+    {
+        tag(field, Len);
+        buf.append(PlaceholderSize, '\0');
+        return buf.size();
+    }
+
+    // Sets size of message started at 'pos' to span till the end of buffer.
+    // Uses fixed-width varint, which is valid if not the shortest encoding.
+    void end(size_t pos)
+    {
+        size_t len = buf.size() - pos;
+        if (len >> (7 * PlaceholderSize)) {
+            throw std::length_error("protobuf message is too long");
+        }
+
+        auto out = &buf[pos - PlaceholderSize];
+        for (size_t i = 0; i < PlaceholderSize - 1; i++) {
+            *out++ = (char)(len | 0x80);
+            len >>= 7;
+        }
+        *out = (char)len;
+    }
+
+private:
+    enum WireType {
+        Varint = 0,
+        Fixed64 = 1,
+        Len = 2,
+        Fixed32 = 5
+    };
+
+    static const size_t PlaceholderSize = 4;
+
+    void tag(uint32_t field, WireType type)
+    {
+        varint(field << 3 | type);
+    }
+
+    std::string& buf;
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <signal.h>
+
+#include "str_view.hpp"
+
+// Request rate, errors and duration per route, method and status class,
+// kept in shared memory. Each worker owns cells it updates with plain stores,
+// so requests take no locks or atomic read-modify-write. Cells of exited
+// workers are taken over by the next ones with the same key, so values stay
+// cumulative since the zone is created and it doesn't grow on reloads. The
+// exporting worker sums them up over all cells.
+class RedMetrics {
+public:
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "lock-free atomics are required to share them between processes");
+
+    // Exponential histogram of milliseconds with base 2^(2^-Scale), i.e.
+    // about 19% relative error. Bucket 'i' has values in (base^i, base^i+1].
+    static const int Scale = 2;
+    static const int BucketCount = 88;
+
+    // the first bucket has 1ms, the last one also takes values over ~58m
+    static const int MinIndex = -1;
+
+    static const size_t MaxRouteSize = 64;
+    static const size_t MaxMethodSize = 16;
+
+    struct Exemplar {
+        uint8_t traceId[16];
+        uint8_t spanId[8];
+
+        // in nanoseconds since epoch
+        uint64_t time;
+        uint64_t value;
+    };
+
+    class Cell {
+    public:
+        StrView route() const
+        {
+            return StrView(routeBuf, routeLen);
+        }
+
+        StrView method() const
+        {
+            return StrView(methodBuf, methodLen);
+        }
+
+        int statusClass() const
+        {
+            return status;
+        }
+
+        // called only by the owning worker
+        void add(uint64_t ms)
+        {
+            bump(count, 1);
+            bump(sum, ms);
+
+            if (ms == 0) {
+                bump(zeroCount, 1);
+                return;
+            }
+
+            int i = (int)std::ceil(std::log2((double)ms) * (1 << Scale)) - 1;
+
+            i -= MinIndex;
+            if (i < 0) {
+                i = 0;
+            } else if (i >= BucketCount) {
+                i = BucketCount - 1;
+            }
+
+            bump(buckets[i], 1);
+        }
+
+        void setExemplar(const Exemplar& ex)
+        {
+            uint64_t words[ExemplarWords];
+            std::memcpy(words, &ex, sizeof(ex));
+
+            auto seq = exemplarSeq.load(std::memory_order_relaxed);
+
+            exemplarSeq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            for (size_t i = 0; i < ExemplarWords; i++) {
+                exemplar[i].store(words[i], std::memory_order_relaxed);
+            }
+
+            exemplarSeq.store(seq + 2, std::memory_order_release);
+        }
+
+        // fails if there's none or it's being updated
+        bool getExemplar(Exemplar& ex) const
+        {
+            auto seq = exemplarSeq.load(std::memory_order_acquire);
+            if (seq == 0 || seq % 2) {
+                return false;
+            }
+
+            uint64_t words[ExemplarWords];
+            for (size_t i = 0; i < ExemplarWords; i++) {
+                words[i] = exemplar[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (exemplarSeq.load(std::memory_order_relaxed) != seq) {
+                return false;
+            }
+
+            std::memcpy(&ex, words, sizeof(ex));
+            return true;
+        }
+
+        uint64_t getCount() const
+        {
+            return count.load(std::memory_order_relaxed);
+        }
+
+        uint64_t getSum() const
+        {
+            return sum.load(std::memory_order_relaxed);
+        }
+
+        uint64_t getZeroCount() const
+        {
+            return zeroCount.load(std::memory_order_relaxed);
+        }
+
+        uint64_t getBucket(int i) const
+        {
+            return buckets[i].load(std::memory_order_relaxed);
+        }
+
+    private:
+        friend class RedMetrics;
+
+        bool matches(StrView route, StrView method, int statusClass) const
+        {
+            return status == statusClass && this->route() == route &&
+                this->method() == method;
+        }
+
+        // not owned or its owner has exited without releasing it
+        bool vacant() const
+        {
+            pid_t pid = owner.load(std::memory_order_relaxed);
+            return pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH);
+        }
+
+        static const size_t ExemplarWords = sizeof(Exemplar) / 8;
+
+        static void bump(std::atomic<uint64_t>& value, uint64_t delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+        }
+
+        std::atomic<pid_t> owner;
+
+        uint8_t status;
+        uint8_t routeLen;
+        uint8_t methodLen;
+
+        char routeBuf[MaxRouteSize];
+        char methodBuf[MaxMethodSize];
+
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> zeroCount;
+        std::atomic<uint64_t> buckets[BucketCount];
+
+        std::atomic<uint32_t> exemplarSeq;
+        std::atomic<uint64_t> exemplar[ExemplarWords];
+    };
+
+    // 'now' is in nanoseconds since epoch
+    static RedMetrics* create(void* mem, size_t size, uint64_t now)
+    {
+        auto metrics = new (mem) RedMetrics();
+
+        metrics->capacity = (size - sizeof(RedMetrics)) / sizeof(Cell);
+        metrics->startTime = now;
+
+        return metrics;
+    }
+
+    // Returns a vacant cell with the key for 'pid' to update, adding one if
+    // there's none, or NULL if zone is full. 'route' and 'method' may be
+    // truncated. Must be called under a lock shared by all workers.
+    Cell* acquireCell(StrView route, StrView method, int statusClass,
+        pid_t pid)
+    {
+        route = route.substr(0, MaxRouteSize);
+        method = method.substr(0, MaxMethodSize);
+
+        auto n = used.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < n; i++) {
+            auto cell = &cells()[i];
+
+            if (cell->matches(route, method, statusClass) && cell->vacant()) {
+                cell->owner.store(pid, std::memory_order_relaxed);
+                return cell;
+            }
+        }
+
+        if (n == capacity) {
+            return NULL;
+        }
+
+        // zeroed on zone allocation
+        auto cell = &cells()[n];
+
+        cell->owner.store(pid, std::memory_order_relaxed);
+        cell->status = statusClass;
+
+        cell->routeLen = route.size();
+        std::memcpy(cell->routeBuf, route.data(), route.size());
+
+        cell->methodLen = method.size();
+        std::memcpy(cell->methodBuf, method.data(), method.size());
+
+        used.store(n + 1, std::memory_order_release);
+
+        return cell;
+    }
+
+    // lets the next worker take over the cell
+    static void releaseCell(Cell* cell)
+    {
+        cell->owner.store(0, std::memory_order_relaxed);
+    }
+
+    template <class F>
+    void forEach(F fn) const
+    {
+        auto n = used.load(std::memory_order_acquire);
+
+        for (size_t i = 0; i < n; i++) {
+            fn(cells()[i]);
+        }
+    }
+
+    // in nanoseconds since epoch
+    uint64_t getStartTime() const
+    {
+        return startTime;
+    }
+
+private:
+    RedMetrics() {}
+
+    Cell* cells() const
+    {
+        return (Cell*)(this + 1);
+    }
+
+    size_t capacity;
+    uint64_t startTime;
+
+    std::atomic<size_t> used{0};
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <functional>
+
+#include "ngx.hpp"
+#include "batch_exporter.hpp"
+
+// Spans of other modules, e.g. stream one, are exported by http module along
+// with its own ones, so "otel_exporter" is only configured in "http" block.
+
+// if false, there's no exporter in 'cycle' to add spans to
+bool hasSharedExporter(ngx_cycle_t* cycle);
+
+// fails if buffers are full
+bool addSharedSpan(const BatchExporter::SpanInfo& info,
+    const std::function<void (BatchExporter::Span&)>& fillSpan);
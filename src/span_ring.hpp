@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <signal.h>
+
+#include "str_view.hpp"
+
+// Multi-producer single-consumer ring of variable-sized records. It lives in
+// shared memory, so that all workers can hand encoded spans to one exporter.
+class SpanRing {
+public:
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "lock-free atomics are required to share them between processes");
+
+    static SpanRing* create(void* mem, size_t size)
+    {
+        std::memset(mem, 0, size);
+
+        return new (mem) SpanRing((size - sizeof(SpanRing)) & ~(Align - 1));
+    }
+
+    // Reserves space for a record, calls 'write' to fill it and publishes it.
+    // Fails if the consumer can't keep up and there is no free space left.
+    // Reserved space is stamped with 'pid' right away, so that it's skipped
+    // if the process dies before publishing the record. It may still die
+    // between reserving and stamping it, but that's a few stores apart.
+    template <class F>
+    bool push(size_t len, pid_t pid, F write)
+    {
+        size_t size = align(sizeof(Header) + len);
+        if (size > capacity || size > SizeMask) {
+            return false;
+        }
+
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        size_t pad;
+
+        do {
+            // records are contiguous, so skip the tail if it's too short
+            size_t left = capacity - pos % capacity;
+            pad = left < size ? left : 0;
+
+            if (pos + pad + size - tail.load(std::memory_order_acquire) >
+                    capacity) {
+                return false;
+            }
+
+        } while (!head.compare_exchange_weak(pos, pos + pad + size,
+            std::memory_order_relaxed));
+
+        if (pad) {
+            header(pos)->size.store(pad | Padding, std::memory_order_release);
+            pos += pad;
+        }
+
+        auto h = header(pos);
+        h->owner.store(pid, std::memory_order_relaxed);
+        h->size.store(size | Reserved, std::memory_order_release);
+
+        h->len = len;
+        write((char*)(h + 1));
+        h->size.store(size, std::memory_order_release);
+
+        return true;
+    }
+
+    // Passes published records to 'read' in order, until it returns false or
+    // an unpublished record is met. Records left unpublished by exited
+    // processes are dropped. Only the owner may call this.
+    template <class F>
+    void drain(F read)
+    {
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+
+        for ( ;; ) {
+            auto h = header(pos);
+
+            uint32_t size = h->size.load(std::memory_order_acquire);
+            if (size == 0) {
+                break;
+            }
+
+            if (size & Reserved) {
+                pid_t pid = h->owner.load(std::memory_order_relaxed);
+                if (kill(pid, 0) == 0 || errno != ESRCH) {
+                    break;
+                }
+
+            } else if (!(size & Padding) &&
+                !read(StrView((char*)(h + 1), h->len)))
+            {
+                break;
+            }
+
+            size &= SizeMask;
+
+            // producers rely on free space being zeroed
+            std::memset((void*)(h + 1), 0, size - sizeof(Header));
+            h->len = 0;
+            h->owner.store(0, std::memory_order_relaxed);
+            h->size.store(0, std::memory_order_relaxed);
+
+            pos += size;
+            tail.store(pos, std::memory_order_release);
+        }
+    }
+
+    // Makes the calling process a single consumer, taking over from
+    // a previous owner that has exited without releasing the ring.
+    bool lock(pid_t pid)
+    {
+        pid_t current = 0;
+        if (owner.compare_exchange_strong(current, pid) || current == pid) {
+            return true;
+        }
+
+        if (kill(current, 0) == -1 && errno == ESRCH) {
+            return owner.compare_exchange_strong(current, pid);
+        }
+
+        return false;
+    }
+
+    void unlock(pid_t pid)
+    {
+        owner.compare_exchange_strong(pid, 0);
+    }
+
+private:
+    struct Header {
+        std::atomic<uint32_t> size;
+        uint32_t len;
+        // producer of reserved record
+        std::atomic<pid_t> owner;
+        uint32_t unused;
+    };
+
+    static const size_t Align = sizeof(Header);
+    static const uint32_t Padding = 0x80000000;
+    static const uint32_t Reserved = 0x40000000;
+    static const uint32_t SizeMask = ~(Padding | Reserved);
+
+    SpanRing(size_t capacity) : capacity(capacity) {}
+
+    static size_t align(size_t size)
+    {
+        return (size + Align - 1) & ~(Align - 1);
+    }
+
+    Header* header(uint64_t pos)
+    {
+        return (Header*)(data + pos % capacity);
+    }
+
+    const size_t capacity;
+
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<pid_t> owner{0};
+
+    alignas(Header) char data[1];
+};
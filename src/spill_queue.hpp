@@ -0,0 +1,350 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#include "str_view.hpp"
+
+// Size-capped FIFO of export requests in memory-mapped segment files.
+// Consumed position is stored in the files. They are named by pid, so that
+// no two processes write the same ones, and are picked up once their process
+// has exited. It's not synced to disk and may lose the tail on system crash.
+class SpillQueue {
+public:
+    SpillQueue(const std::string& dir, size_t maxSize) :
+        dir(dir), prefix(dir + "/" + std::to_string(getpid()) + "."),
+        maxSize(maxSize),
+        segmentSize(maxSize < MaxSegmentSize ? maxSize : MaxSegmentSize)
+    {
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::system_category(), dir);
+        }
+
+        if (!adoptSegments()) {
+            throw std::system_error(errno, std::system_category(), dir);
+        }
+
+        lastAdopt = time(NULL);
+    }
+
+    ~SpillQueue()
+    {
+        for (auto& seg : segments) {
+            munmap(seg.mem, seg.size);
+        }
+    }
+
+    // returns false if out of space
+    bool push(StrView data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t need = align(sizeof(uint32_t) + data.size());
+
+        if (segments.empty() || segments.back().size - segments.back().tail <
+                need) {
+            if (!createSegment(sizeof(Header) + need)) {
+                return false;
+            }
+        }
+
+        auto& seg = segments.back();
+
+        std::memcpy(seg.mem + seg.tail + sizeof(uint32_t), data.data(),
+            data.size());
+
+        // length is written last, so partial record is not read back
+        std::atomic_signal_fence(std::memory_order_release);
+
+        uint32_t len = data.size();
+        std::memcpy(seg.mem + seg.tail, &len, sizeof(len));
+
+        seg.tail += need;
+
+        return true;
+    }
+
+    // Oldest request or empty view. It stays valid till pop().
+    StrView front()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (segments.empty()) {
+            // processes replaced on reload leave their segments behind
+            auto now = time(NULL);
+            if (now == lastAdopt) {
+                return StrView();
+            }
+
+            lastAdopt = now;
+            adoptSegments();
+
+            if (segments.empty()) {
+                return StrView();
+            }
+        }
+
+        auto& seg = segments.front();
+        auto head = seg.header()->head;
+
+        if (head == seg.tail) {
+            return StrView();
+        }
+
+        uint32_t len;
+        std::memcpy(&len, seg.mem + head, sizeof(len));
+
+        return StrView(seg.mem + head + sizeof(len), len);
+    }
+
+    void pop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (segments.empty()) {
+            return;
+        }
+
+        auto& seg = segments.front();
+        auto header = seg.header();
+
+        if (header->head == seg.tail) {
+            return;
+        }
+
+        uint32_t len;
+        std::memcpy(&len, seg.mem + header->head, sizeof(len));
+
+        header->head += align(sizeof(len) + len);
+
+        if (header->head == seg.tail) {
+            removeFront();
+        }
+    }
+
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t head;
+    };
+
+    struct Segment {
+        uint64_t seq;
+        char* mem;
+        size_t size;
+        size_t tail;
+
+        Header* header()
+        {
+            return (Header*)mem;
+        }
+    };
+
+    static const uint32_t Magic = 0x4c50534f; // "OSPL"
+    static const size_t MaxSegmentSize = 4 * 1024 * 1024;
+
+    static size_t align(size_t size)
+    {
+        return (size + 7) & ~(size_t)7;
+    }
+
+    std::string path(uint64_t seq)
+    {
+        return prefix + std::to_string(seq);
+    }
+
+    // Renames segments of exited processes to own ones, in order. Whoever
+    // renames a file first owns it. Own segments left by a previous process
+    // with the same pid are taken over as well, which is only done while
+    // there are no segments yet.
+    bool adoptSegments()
+    {
+        struct File {
+            pid_t pid;
+            uint64_t seq;
+        };
+
+        auto d = opendir(dir.c_str());
+        if (d == NULL) {
+            return false;
+        }
+
+        std::vector<File> found;
+        pid_t self = getpid();
+
+        while (auto entry = readdir(d)) {
+            char* end;
+            auto pid = std::strtol(entry->d_name, &end, 10);
+            if (end == entry->d_name || *end != '.' || pid <= 0) {
+                continue;
+            }
+
+            auto start = end + 1;
+            auto seq = std::strtoull(start, &end, 10);
+            if (end == start || *end != '\0') {
+                continue;
+            }
+
+            if (pid == self || (kill(pid, 0) == -1 && errno == ESRCH)) {
+                found.push_back({(pid_t)pid, seq});
+            }
+        }
+
+        closedir(d);
+
+        // own files go first, so they are never renamed over each other
+        std::sort(found.begin(), found.end(),
+            [self](const File& a, const File& b) {
+                return std::make_tuple(a.pid != self, a.pid, a.seq) <
+                    std::make_tuple(b.pid != self, b.pid, b.seq);
+            });
+
+        for (auto& file : found) {
+            auto from = dir + "/" + std::to_string(file.pid) + "." +
+                std::to_string(file.seq);
+
+            if (rename(from.c_str(), path(nextSeq).c_str()) == 0) {
+                openSegment(nextSeq++);
+            }
+        }
+
+        return true;
+    }
+
+    void openSegment(uint64_t seq)
+    {
+        auto file = path(seq);
+
+        int fd = open(file.c_str(), O_RDWR);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+        void* mem = MAP_FAILED;
+
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(Header) &&
+                (size_t)st.st_size <= UINT32_MAX) {
+            mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+        }
+
+        close(fd);
+
+        if (mem == MAP_FAILED) {
+            unlink(file.c_str());
+            return;
+        }
+
+        Segment seg{seq, (char*)mem, (size_t)st.st_size, 0};
+
+        auto header = seg.header();
+        if (header->magic != Magic || header->head < sizeof(Header) ||
+                header->head > seg.size) {
+            munmap(seg.mem, seg.size);
+            unlink(file.c_str());
+            return;
+        }
+
+        // records end with zero length or at the end of file
+        seg.tail = header->head;
+        while (seg.size - seg.tail >= sizeof(uint32_t)) {
+            uint32_t len;
+            std::memcpy(&len, seg.mem + seg.tail, sizeof(len));
+
+            if (len == 0 || seg.size - seg.tail < align(sizeof(len) + len)) {
+                break;
+            }
+
+            seg.tail += align(sizeof(len) + len);
+        }
+
+        if (seg.tail == header->head) {
+            munmap(seg.mem, seg.size);
+            unlink(file.c_str());
+            return;
+        }
+
+        segments.push_back(seg);
+        totalSize += seg.size;
+    }
+
+    bool createSegment(size_t minSize)
+    {
+        auto size = std::max(segmentSize, minSize);
+
+        if (totalSize + size > maxSize || size > UINT32_MAX) {
+            return false;
+        }
+
+        auto file = path(nextSeq);
+
+        int fd = open(file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            return false;
+        }
+
+        // allocate blocks now to avoid SIGBUS on write if disk is full
+        void* mem = MAP_FAILED;
+        if (posix_fallocate(fd, 0, size) == 0) {
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mem == MAP_FAILED) {
+            unlink(file.c_str());
+            return false;
+        }
+
+        Segment seg{nextSeq++, (char*)mem, size, sizeof(Header)};
+
+        seg.header()->magic = Magic;
+        seg.header()->head = sizeof(Header);
+
+        segments.push_back(seg);
+        totalSize += size;
+
+        return true;
+    }
+
+    void removeFront()
+    {
+        auto& seg = segments.front();
+
+        munmap(seg.mem, seg.size);
+        unlink(path(seg.seq).c_str());
+
+        totalSize -= seg.size;
+        segments.pop_front();
+    }
+
+    const std::string dir;
+    const std::string prefix;
+    const size_t maxSize;
+    const size_t segmentSize;
+
+    std::mutex mutex;
+    std::deque<Segment> segments;
+    size_t totalSize{0};
+    uint64_t nextSeq{0};
+    time_t lastAdopt;
+};
@@ -0,0 +1,347 @@
+#include "ngx.hpp"
+
+extern "C" {
+#include <ngx_stream.h>
+}
+
+#include "str_view.hpp"
+#include "trace_context.hpp"
+#include "trace_sampler.hpp"
+#include "shared_exporter.hpp"
+
+extern ngx_module_t gStreamModule;
+
+namespace {
+
+struct MainConf {
+    // enabled in any server
+    bool trace;
+};
+
+struct ServerConf {
+    ngx_stream_complex_value_t* trace;
+    TraceSampler* sampler;
+    ngx_stream_complex_value_t* spanName;
+};
+
+char* setSampler(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+ngx_command_t gCommands[] = {
+
+    { ngx_string("otel_trace"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_set_complex_value_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ServerConf, trace) },
+
+    { ngx_string("otel_sampler"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      setSampler,
+      NGX_STREAM_SRV_CONF_OFFSET },
+
+    { ngx_string("otel_span_name"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_set_complex_value_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ServerConf, spanName) },
+
+      ngx_null_command
+};
+
+StrView toStrView(ngx_str_t str)
+{
+    return StrView((char*)str.data, str.len);
+}
+
+MainConf* getMainConf(ngx_conf_t* cf)
+{
+    return (MainConf*)ngx_stream_conf_get_module_main_conf(cf, gStreamModule);
+}
+
+MainConf* getMainConf(ngx_cycle_t* cycle)
+{
+    return (MainConf*)ngx_stream_cycle_get_module_main_conf(cycle,
+        gStreamModule);
+}
+
+ServerConf* getServerConf(ngx_stream_session_t* s)
+{
+    return (ServerConf*)ngx_stream_get_module_srv_conf(s, gStreamModule);
+}
+
+StrView getSpanName(ngx_stream_session_t* s)
+{
+    auto scf = getServerConf(s);
+
+    if (scf->spanName) {
+        ngx_str_t result;
+        if (ngx_stream_complex_value(s, scf->spanName, &result) != NGX_OK) {
+            throw std::runtime_error("failed to compute complex value");
+        }
+
+        return toStrView(result);
+    }
+
+    return "stream";
+}
+
+void addDefaultAttrs(BatchExporter::Span& span, ngx_stream_session_t* s)
+{
+    // based on trace semantic conventions for network from 1.16.0 OTel spec
+
+    auto c = s->connection;
+
+    span.add("net.transport", c->type == SOCK_DGRAM ? "ip_udp" : "ip_tcp");
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) == NGX_OK) {
+        span.add("net.host.port", ngx_inet_get_port(c->local_sockaddr));
+    }
+
+    span.add("net.sock.peer.addr", toStrView(c->addr_text));
+    span.add("net.sock.peer.port", ngx_inet_get_port(c->sockaddr));
+
+    // from and to client
+    span.add("nginx.stream.bytes_received", s->received);
+    span.add("nginx.stream.bytes_sent", c->sent);
+
+    span.add("nginx.stream.status", s->status);
+
+    if (s->status >= 500) {
+        span.setError();
+    }
+
+    auto states = s->upstream_states;
+    if (states == NULL || states->nelts == 0) {
+        return;
+    }
+
+    // the last one, which session was proxied to
+    auto& state =
+        ((ngx_stream_upstream_state_t*)states->elts)[states->nelts - 1];
+
+    if (state.peer) {
+        span.add("nginx.upstream.addr", toStrView(*state.peer));
+    }
+
+    if (state.connect_time != (ngx_msec_t)-1) {
+        span.addDouble("nginx.upstream.connect_time",
+            state.connect_time / 1000.0);
+    }
+
+    if (state.first_byte_time != (ngx_msec_t)-1) {
+        span.addDouble("nginx.upstream.first_byte_time",
+            state.first_byte_time / 1000.0);
+    }
+
+    span.add("nginx.upstream.bytes_sent", state.bytes_sent);
+    span.add("nginx.upstream.bytes_received", state.bytes_received);
+}
+
+// There's no trace context to inherit in stream protocols, so each session
+// is a root span, and sampling is decided once it's done.
+ngx_int_t onSessionEnd(ngx_stream_session_t* s)
+{
+    auto scf = getServerConf(s);
+    if (scf->trace == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_str_t trace;
+    if (ngx_stream_complex_value(s, scf->trace, &trace) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (toStrView(trace) != "on" && toStrView(trace) != "1") {
+        return NGX_DECLINED;
+    }
+
+    auto tc = TraceContext::generate(true);
+
+    auto sampler = scf->sampler;
+    if (sampler) {
+        if (!sampler->sample(TraceContext{}, tc)) {
+            return NGX_DECLINED;
+        }
+
+        auto buf = (char*)ngx_pnalloc(s->connection->pool,
+            TraceSampler::stateSize(tc.state));
+        if (buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        tc.state = StrView(buf, sampler->updateState(tc.state, true, buf));
+    }
+
+    auto now = ngx_timeofday();
+
+    auto toNanoSec = [](time_t sec, ngx_msec_t msec) -> uint64_t {
+        return (sec * 1000 + msec) * 1000000;
+    };
+
+    try {
+        BatchExporter::SpanInfo info{
+            getSpanName(s), tc, opentelemetry::trace::SpanId(),
+            toNanoSec(s->start_sec, s->start_msec),
+            toNanoSec(now->sec, now->msec)};
+
+        bool ok = addSharedSpan(info, [s, sampler](BatchExporter::Span& span) {
+            addDefaultAttrs(span, s);
+
+            if (sampler) {
+                span.addDouble("nginx.sampling.probability",
+                    sampler->probability());
+            }
+        });
+
+        if (!ok) {
+            static size_t dropped = 0;
+            static time_t lastLog = 0;
+            ++dropped;
+            if (lastLog != ngx_time()) {
+                lastLog = ngx_time();
+                ngx_log_error(NGX_LOG_NOTICE, s->connection->log, 0,
+                    "OTel dropped records: %uz", dropped);
+            }
+        }
+
+    } catch (const std::exception& e) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+            "OTel failed to add span: %s", e.what());
+        return NGX_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+ngx_int_t initModule(ngx_conf_t* cf)
+{
+    auto cmcf = (ngx_stream_core_main_conf_t*)
+        ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    auto h = (ngx_stream_handler_pt*)ngx_array_push(
+        &cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = onSessionEnd;
+
+    return NGX_OK;
+}
+
+// "http" block, which has the exporter, may follow "stream" one, so it's
+// checked once the whole configuration is read
+ngx_int_t checkExporter(ngx_cycle_t* cycle)
+{
+    auto mcf = getMainConf(cycle);
+
+    if (mcf && mcf->trace && !hasSharedExporter(cycle)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+            "\"otel_exporter\" block is missing in \"http\"");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+void* createMainConf(ngx_conf_t* cf)
+{
+    return ngx_pcalloc(cf->pool, sizeof(MainConf));
+}
+
+void* createServerConf(ngx_conf_t* cf)
+{
+    auto conf = (ServerConf*)ngx_pcalloc(cf->pool, sizeof(ServerConf));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->trace = (ngx_stream_complex_value_t*)NGX_CONF_UNSET_PTR;
+    conf->sampler = (TraceSampler*)NGX_CONF_UNSET_PTR;
+    conf->spanName = (ngx_stream_complex_value_t*)NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+char* mergeServerConf(ngx_conf_t* cf, void* parent, void* child)
+{
+    auto prev = (ServerConf*)parent;
+    auto conf = (ServerConf*)child;
+
+    ngx_conf_merge_ptr_value(conf->trace, prev->trace, NULL);
+    ngx_conf_merge_ptr_value(conf->sampler, prev->sampler, NULL);
+    ngx_conf_merge_ptr_value(conf->spanName, prev->spanName, NULL);
+
+    if (conf->trace) {
+        getMainConf(cf)->trace = true;
+    }
+
+    return NGX_CONF_OK;
+}
+
+// only ratio, as there's no parent to follow, nor shared rate limit zones
+char* setSampler(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
+{
+    auto scf = (ServerConf*)conf;
+
+    if (scf->sampler != NGX_CONF_UNSET_PTR) {
+        return (char*)"is duplicate";
+    }
+
+    scf->sampler = NULL;
+
+    auto args = (ngx_str_t*)cf->args->elts;
+    auto arg = toStrView(args[1]);
+
+    if (arg == "off") {
+        return NGX_CONF_OK;
+    }
+
+    if (!startsWith(arg, "ratio=")) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &args[1]);
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    auto ratio = ngx_atofp(args[1].data + 6, args[1].len - 6, 6);
+    if (ratio == NGX_ERROR || ratio > TraceSampler::RatioScale) {
+        return (char*)"has invalid ratio";
+    }
+
+    auto mem = ngx_palloc(cf->pool, sizeof(TraceSampler));
+    if (mem == NULL) {
+        return (char*)NGX_CONF_ERROR;
+    }
+
+    scf->sampler = new (mem) TraceSampler(ratio, false);
+
+    return NGX_CONF_OK;
+}
+
+ngx_stream_module_t gStreamModuleCtx = {
+    NULL,                               /* preconfiguration */
+    initModule,                         /* postconfiguration */
+
+    createMainConf,                     /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    createServerConf,                   /* create server configuration */
+    mergeServerConf                     /* merge server configuration */
+};
+
+}
+
+ngx_module_t gStreamModule = {
+    NGX_MODULE_V1,
+    &gStreamModuleCtx,                  /* module context */
+    gCommands,                          /* module directives */
+    NGX_STREAM_MODULE,                  /* module type */
+    NULL,                               /* init master */
+    checkExporter,                      /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+// Token bucket shared by all workers to cap sampled requests per second.
+// It's kept as a single "theoretical arrival time" (GCRA), so taking a token
+// is one CAS. Burst is up to a second worth of tokens. Share of requests
+// that got a token over the last second is their sampling probability.
+class TokenBucket {
+public:
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "lock-free atomics are required to share them between processes");
+
+    static const uint32_t ShareScale = 1000000;
+
+    static TokenBucket* create(void* mem)
+    {
+        return new (mem) TokenBucket();
+    }
+
+    // 'now' is in microseconds
+    bool take(uint64_t now, uint64_t rate)
+    {
+        countRequest(now);
+
+        uint64_t interval = 1000000 / rate;
+        if (interval == 0) {
+            interval = 1;
+        }
+
+        uint64_t tat = next.load(std::memory_order_relaxed);
+        uint64_t newTat;
+
+        do {
+            newTat = (tat > now ? tat : now) + interval;
+
+            if (newTat > now + 1000000) {
+                return false;
+            }
+
+        } while (!next.compare_exchange_weak(tat, newTat,
+            std::memory_order_relaxed));
+
+        taken.fetch_add(1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    // in millionths
+    uint32_t share() const
+    {
+        return lastShare.load(std::memory_order_relaxed);
+    }
+
+private:
+    TokenBucket() {}
+
+    void countRequest(uint64_t now)
+    {
+        uint64_t sec = now / 1000000;
+
+        uint64_t cur = window.load(std::memory_order_relaxed);
+        if (cur != sec && window.compare_exchange_strong(cur, sec,
+                std::memory_order_relaxed)) {
+            uint64_t total = requests.exchange(0, std::memory_order_relaxed);
+            uint64_t passed = taken.exchange(0, std::memory_order_relaxed);
+
+            lastShare.store(total && passed < total ?
+                passed * ShareScale / total : ShareScale,
+                std::memory_order_relaxed);
+        }
+
+        requests.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> next{0};
+
+    std::atomic<uint64_t> window{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> taken{0};
+    std::atomic<uint32_t> lastShare{ShareScale};
+};
@@ -1,11 +1,13 @@
 #pragma once
 
-#include <array>
+#include <cstring>
+
 #include <opentelemetry/trace/trace_id.h>
 #include <opentelemetry/trace/span_id.h>
 #include <opentelemetry/trace/propagation/http_trace_context.h>
-#include <opentelemetry/sdk/trace/random_id_generator.h>
 
+#include "hex.hpp"
+#include "id_generator.hpp"
 #include "str_view.hpp"
 
 struct TraceContext {
@@ -17,51 +19,116 @@ struct TraceContext {
     static const auto Size =
         opentelemetry::trace::propagation::kTraceParentSize;
 
+    // of "b3" and "uber-trace-id" headers
+    static const size_t B3Size = 32 + 1 + 16 + 1 + 1;
+    static const size_t JaegerSize = 32 + 1 + 16 + 1 + 1 + 1 + 2;
+
     static TraceContext generate(bool sampled, TraceContext parent = {})
     {
-        opentelemetry::sdk::trace::RandomIdGenerator idGen;
+        using namespace opentelemetry::trace;
+
+        uint8_t traceId[TraceId::kSize];
+        uint8_t spanId[SpanId::kSize];
+
+        if (!parent.traceId.IsValid()) {
+            IdGenerator::generate(traceId);
+        }
 
-        return {parent.traceId.IsValid() ?
-                    parent.traceId : idGen.GenerateTraceId(),
-                idGen.GenerateSpanId(),
+        IdGenerator::generate(spanId);
+
+        return {parent.traceId.IsValid() ? parent.traceId : TraceId(traceId),
+                SpanId(spanId),
                 sampled,
                 parent.state};
     }
 
     static TraceContext parse(StrView trace, StrView state)
     {
-        using namespace opentelemetry::trace::propagation;
+        using namespace opentelemetry::trace;
 
-        std::array<StrView, 4> parts;
-        if (detail::SplitString(trace, '-', parts.data(), 4) != 4) {
+        // "00-" trace-id "-" parent-id "-" flags, fields after are ignored
+        if (trace.size() < Size ||
+            (trace.size() > Size && trace.data()[Size] != '-'))
+        {
             return TraceContext{};
         }
 
-        auto version = parts[0];
-        auto traceId = parts[1];
-        auto spanId = parts[2];
-        auto flags = parts[3];
+        auto p = trace.data();
 
-        if (version != "00") {
+        if (p[0] != '0' || p[1] != '0' || p[2] != '-' || p[35] != '-' ||
+            p[52] != '-')
+        {
             return TraceContext{};
         }
 
-        if (traceId.size() != kTraceIdSize || spanId.size() != kSpanIdSize ||
-            flags.size() != kTraceFlagsSize)
+        uint8_t traceId[TraceId::kSize];
+        uint8_t spanId[SpanId::kSize];
+        uint8_t flags;
+
+        if (!decodeHex(p + 3, traceId, sizeof(traceId)) ||
+            !decodeHex(p + 36, spanId, sizeof(spanId)) ||
+            !decodeHex(p + 53, &flags, 1))
         {
             return TraceContext{};
         }
 
-        if (!detail::IsValidHex(traceId) || !detail::IsValidHex(spanId) ||
-            !detail::IsValidHex(flags))
-        {
+        return {TraceId(traceId), SpanId(spanId), (flags & 1) != 0, state};
+    }
+
+    // {trace-id}-{span-id}[-{sampling-state}[-{parent-span-id}]]
+    static TraceContext parseB3(StrView b3)
+    {
+        StrView parts[4];
+        auto n = split(b3, '-', parts);
+
+        if (n < 2 || !isB3TraceId(parts[0]) || parts[1].size() != 16) {
             return TraceContext{};
         }
 
-        return {HttpTraceContext::TraceIdFromHex(traceId),
-                HttpTraceContext::SpanIdFromHex(spanId),
-                HttpTraceContext::TraceFlagsFromHex(flags).IsSampled(),
-                state};
+        auto sampled = n > 2 && (parts[2] == "1" || parts[2] == "d");
+
+        return fromIds(parts[0], parts[1], sampled);
+    }
+
+    static TraceContext parseB3Multi(StrView traceId, StrView spanId,
+        StrView sampled, StrView flags)
+    {
+        if (!isB3TraceId(traceId) || spanId.size() != 16) {
+            return TraceContext{};
+        }
+
+        return fromIds(traceId, spanId,
+            sampled == "1" || sampled == "true" || flags == "1");
+    }
+
+    // {trace-id}:{span-id}:{parent-span-id}:{flags}
+    static TraceContext parseJaeger(StrView value)
+    {
+        StrView parts[4];
+        uint8_t flags;
+
+        if (split(value, ':', parts) != 4 || !decodeId(parts[3], flags)) {
+            return TraceContext{};
+        }
+
+        return fromIds(parts[0], parts[1], flags & 1);
+    }
+
+    static void serializeB3(const TraceContext& tc, char* out)
+    {
+        out = serializeIds(tc, '-', out);
+        *out++ = '-';
+        *out++ = tc.sampled ? '1' : '0';
+    }
+
+    static void serializeJaeger(const TraceContext& tc, char* out)
+    {
+        out = serializeIds(tc, ':', out);
+        *out++ = ':';
+        *out++ = '0';
+        *out++ = ':';
+        *out++ = '0';
+        *out++ = tc.sampled ? '1' : '0';
     }
 
     static void serialize(const TraceContext& tc, char* out)
@@ -72,15 +139,99 @@ struct TraceContext {
         *out++ = '0';
         *out++ = '-';
 
-        tc.traceId.ToLowerBase16({out, kTraceIdSize});
+        encodeHex(tc.traceId.Id().data(), tc.traceId.Id().size(), out);
         out += kTraceIdSize;
         *out++ = '-';
 
-        tc.spanId.ToLowerBase16({out, kSpanIdSize});
+        encodeHex(tc.spanId.Id().data(), tc.spanId.Id().size(), out);
         out += kSpanIdSize;
         *out++ = '-';
 
         *out++ = '0';
         *out++ = tc.sampled ? '1' : '0';
     }
+
+private:
+    // 64-bit trace IDs are also allowed in B3
+    static bool isB3TraceId(StrView hex)
+    {
+        return hex.size() == 32 || hex.size() == 16;
+    }
+
+    // splits into at most N parts, the last one takes the rest
+    template <size_t N>
+    static size_t split(StrView str, char sep, StrView (&parts)[N])
+    {
+        size_t n = 0;
+
+        while (n < N - 1) {
+            auto pos = str.find(sep);
+            if (pos == StrView::npos) {
+                break;
+            }
+
+            parts[n++] = str.substr(0, pos);
+            str = str.substr(pos + 1);
+        }
+
+        parts[n++] = str;
+
+        return n;
+    }
+
+    // decodes ID of up to 'N' bytes, shorter ones are padded with zeros
+    template <size_t N>
+    static bool decodeId(StrView hex, uint8_t (&id)[N])
+    {
+        if (hex.empty() || hex.size() > N * 2) {
+            return false;
+        }
+
+        char buf[N * 2];
+        auto pad = sizeof(buf) - hex.size();
+
+        std::memset(buf, '0', pad);
+        std::memcpy(buf + pad, hex.data(), hex.size());
+
+        return decodeHex(buf, id, N);
+    }
+
+    static bool decodeId(StrView hex, uint8_t& id)
+    {
+        uint8_t buf[1];
+
+        if (!decodeId(hex, buf)) {
+            return false;
+        }
+
+        id = buf[0];
+        return true;
+    }
+
+    static TraceContext fromIds(StrView traceHex, StrView spanHex,
+        bool sampled)
+    {
+        using namespace opentelemetry::trace;
+
+        uint8_t traceId[TraceId::kSize];
+        uint8_t spanId[SpanId::kSize];
+
+        if (!decodeId(traceHex, traceId) || !decodeId(spanHex, spanId)) {
+            return TraceContext{};
+        }
+
+        return {TraceId(traceId), SpanId(spanId), sampled, StrView()};
+    }
+
+    static char* serializeIds(const TraceContext& tc, char sep, char* out)
+    {
+        encodeHex(tc.traceId.Id().data(), tc.traceId.Id().size(), out);
+        out += tc.traceId.Id().size() * 2;
+        *out++ = sep;
+
+        encodeHex(tc.spanId.Id().data(), tc.spanId.Id().size(), out);
+        out += tc.spanId.Id().size() * 2;
+
+        return out;
+    }
 };
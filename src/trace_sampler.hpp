@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "trace_context.hpp"
+
+// Consistent probability sampler per OTel tracestate handling spec. It
+// compares 56 random bits of trace ID, or explicit 'rv' from the "ot"
+// tracestate member, with threshold derived from ratio, so all tiers with
+// the same ratio agree on a trace. The threshold of the decision is put to
+// tracestate as 'th' to let backends count sampled out spans.
+class TraceSampler {
+public:
+    static const uint32_t RatioScale = 1000000;
+
+    // 'ratio' is in millionths
+    TraceSampler(uint32_t ratio, bool parentBased) : parentBased(parentBased)
+    {
+        uint64_t keep = ratio >= RatioScale ? MaxThreshold :
+            (uint64_t)((double)ratio * MaxThreshold / RatioScale + 0.5);
+
+        threshold = MaxThreshold - keep;
+
+        // 14 hex digits without trailing zeros
+        for (int i = 0; i < 14; i++) {
+            th[i] = "0123456789abcdef"[(threshold >> (52 - i * 4)) & 0xf];
+        }
+
+        for (thLen = 14; thLen > 1 && th[thLen - 1] == '0'; thLen--) {
+            /* void */
+        }
+    }
+
+    // if true, decision is inherited and tracestate is kept as is
+    bool followsParent(const TraceContext& parent) const
+    {
+        return parentBased && parent.traceId.IsValid();
+    }
+
+    bool sample(const TraceContext& parent, const TraceContext& current) const
+    {
+        if (followsParent(parent)) {
+            return parent.sampled;
+        }
+
+        return randomness(current) >= threshold;
+    }
+
+    // of local decision
+    double probability() const
+    {
+        return (double)(MaxThreshold - threshold) / MaxThreshold;
+    }
+
+    // max size of tracestate after update
+    static size_t stateSize(StrView state)
+    {
+        return state.size() + sizeof("ot=th:;") + 14;
+    }
+
+    // Writes 'state' with threshold of the decision. Updated "ot" member
+    // goes first, as tracestate mutation rules require.
+    size_t updateState(StrView state, bool sampled, char* out) const
+    {
+        auto p = out;
+
+        p = append(p, "ot=");
+
+        auto values = p;
+        if (sampled) {
+            p = append(p, "th:");
+            p = append(p, StrView(th, thLen));
+        }
+
+        forEach(findMember(state), ';', [&](StrView value) {
+            if (!startsWith(value, "th:")) {
+                if (p != values) {
+                    *p++ = ';';
+                }
+                p = append(p, value);
+            }
+        });
+
+        if (p == values) {
+            p = out;
+        }
+
+        forEach(state, ',', [&](StrView member) {
+            if (!startsWith(member, "ot=")) {
+                if (p != out) {
+                    *p++ = ',';
+                }
+                p = append(p, member);
+            }
+        });
+
+        return p - out;
+    }
+
+private:
+    static const uint64_t MaxThreshold = (uint64_t)1 << 56;
+
+    static uint64_t randomness(const TraceContext& tc)
+    {
+        uint64_t rv = 0;
+
+        forEach(findMember(tc.state), ';', [&](StrView value) {
+            if (startsWith(value, "rv:") && value.size() == 3 + 14) {
+                parseHex(value.substr(3), rv);
+            }
+        });
+
+        if (rv) {
+            return rv;
+        }
+
+        // the rightmost 7 bytes
+        auto id = tc.traceId.Id();
+        for (size_t i = id.size() - 7; i < id.size(); i++) {
+            rv = (rv << 8) | id.data()[i];
+        }
+
+        return rv;
+    }
+
+    // value of "ot" tracestate member
+    static StrView findMember(StrView state)
+    {
+        StrView ot;
+
+        forEach(state, ',', [&](StrView member) {
+            if (startsWith(member, "ot=")) {
+                ot = member.substr(3);
+            }
+        });
+
+        return ot;
+    }
+
+    // calls 'fn' for each non-empty item with blanks trimmed
+    template <class Fn>
+    static void forEach(StrView list, char sep, Fn fn)
+    {
+        while (!list.empty()) {
+            auto end = list.find(sep);
+            auto item = list.substr(0, end);
+
+            list = end == StrView::npos ? StrView() : list.substr(end + 1);
+
+            size_t first = 0;
+            size_t last = item.size();
+
+            while (first < last && isBlank(item.data()[first])) {
+                first++;
+            }
+
+            while (last > first && isBlank(item.data()[last - 1])) {
+                last--;
+            }
+
+            if (first < last) {
+                fn(item.substr(first, last - first));
+            }
+        }
+    }
+
+    static bool isBlank(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    static bool parseHex(StrView str, uint64_t& out)
+    {
+        uint64_t val = 0;
+
+        for (auto c : str) {
+            int d;
+            if (c >= '0' && c <= '9') {
+                d = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                d = c - 'a' + 10;
+            } else {
+                return false;
+            }
+            val = (val << 4) | d;
+        }
+
+        out = val;
+        return true;
+    }
+
+    static char* append(char* p, StrView str)
+    {
+        std::memcpy(p, str.data(), str.size());
+        return p + str.size();
+    }
+
+    bool parentBased;
+    uint64_t threshold;
+
+    char th[14];
+    size_t thLen;
+};
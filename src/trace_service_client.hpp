@@ -1,44 +1,24 @@
 #pragma once
 
-#include <functional>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <type_traits>
 
-#include <grpcpp/grpcpp.h>
 #include <grpcpp/alarm.h>
-#include <opentelemetry/proto/collector/trace/v1/trace_service.grpc.pb.h>
+#include <grpcpp/generic/generic_stub.h>
 
-namespace otel_proto_trace = opentelemetry::proto::collector::trace::v1;
+#include "export_client.hpp"
 
-struct Target {
-    typedef std::vector<std::pair<std::string, std::string>> HeaderVec;
-
-    std::string endpoint;
-    bool ssl;
-    std::string trustedCert;
-    HeaderVec headers;
-
-    static bool validateHeaderName(StrView name)
-    {
-        return grpc_header_key_is_legal(
-            grpc_slice_from_static_buffer(name.data(), name.size()));
-    }
-
-    static bool validateHeaderValue(StrView value)
-    {
-        return grpc_header_nonbin_value_is_legal(
-            grpc_slice_from_static_buffer(value.data(), value.size()));
-    }
-};
-
-class TraceServiceClient {
+// OTLP/gRPC client that runs completion queue on its own thread.
+// It exports traces, unless another signal is given.
+class TraceServiceClient : public ExportClient {
 public:
-    typedef otel_proto_trace::ExportTraceServiceRequest Request;
-    typedef otel_proto_trace::ExportTraceServiceResponse Response;
-    typedef otel_proto_trace::TraceService TraceService;
-
-    typedef std::function<void (Request, Response, grpc::Status)>
-        ResponseCb;
-
-    TraceServiceClient(const Target& target) : headers(target.headers)
+    TraceServiceClient(const Target& target, Signal signal = Signal::Traces) :
+        exportMethod(getExportMethod(signal)),
+        headers(target.headers), channels(target.channels),
+        maxInFlight(target.maxInFlight)
     {
         std::shared_ptr<grpc::ChannelCredentials> creds;
         if (target.ssl) {
@@ -49,95 +29,350 @@ public:
         } else {
             creds = grpc::InsecureChannelCredentials();
         }
-        auto channel = grpc::CreateChannel(target.endpoint, creds);
-        channel->GetState(true); // trigger 'connecting' state
 
-        stub = TraceService::NewStub(channel);
+        grpc::ChannelArguments args;
+        args.SetCompressionAlgorithm(target.compression);
+
+        // otherwise channels share connection to the same target
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+
+        for (auto& ch : channels) {
+            auto channel = grpc::CreateCustomChannel(target.endpoint, creds,
+                args);
+            channel->GetState(true); // trigger 'connecting' state
+
+            ch.stub.reset(new grpc::GenericStub(channel));
+        }
+
+        worker = std::thread(&TraceServiceClient::run, this);
     }
 
-    void send(Request& req, ResponseCb cb)
+    ~TraceServiceClient()
     {
-        std::unique_ptr<ActiveCall> call{new ActiveCall{}};
+        gpr_timespec past{};
+        shutdownAlarm.Set(&queue, past, &shutdownAlarm);
 
-        for (auto& header : headers) {
-            call->context.AddMetadata(header.first, header.second);
+        worker.join();
+    }
+
+    // 'getRequest' is called on worker thread. Calls are pooled,
+    // so this must not be called concurrently.
+    void send(RequestCb getRequest, ResponseCb cb) override
+    {
+        auto call = freeCalls;
+        if (call == NULL) {
+            call = returnedCalls.exchange(NULL, std::memory_order_acquire);
         }
 
-        call->request = std::move(req);
+        if (call) {
+            freeCalls = call->next.load(std::memory_order_relaxed);
+        } else {
+            call = new ActiveCall;
+            calls.emplace_back(call);
+        }
+
+        call->getRequest = std::move(getRequest);
         call->cb = std::move(cb);
 
-        ++pending;
+        submitted.push(call);
 
         // post actual RPC to worker thread to minimize load on caller
-        gpr_timespec past{};
-        call->sendAlarm.Set(&queue, past, call.release());
+        if (!wakeSet.exchange(true)) {
+            gpr_timespec past{};
+            wakeAlarm.Set(&queue, past, &wakeAlarm);
+        }
     }
 
+private:
     void run()
     {
         void* tag = NULL;
         bool ok = false;
 
         while (queue.Next(&tag, &ok)) {
-            assert(ok);
+            if (tag == &wakeAlarm) {
+                wakeSet = false;
+                startCalls();
 
-            if (tag == &shutdownAlarm) {
+            } else if (tag == &shutdownAlarm) {
+                // no more calls can be submitted at this point
                 shutdown = true;
-            } else {
-                std::unique_ptr<ActiveCall> call{(ActiveCall*)tag};
 
-                if (!call->sent) {
-                    --pending;
+                for (auto& call : calls) {
+                    if (call->retrying) {
+                        call->retryAlarm.Cancel();
+                    }
+                }
+
+                startCalls();
 
-                    call->responseReader = stub->AsyncExport(
-                        &call->context, call->request, &queue);
-                    call->sent = true;
+            } else {
+                auto call = (ActiveCall*)tag;
 
-                    call->responseReader->Finish(
-                        &call->response, &call->status, call.get());
-                    call.release();
+                if (call->retrying) {
+                    retryCall(call, ok);
                 } else {
-                    call->cb(std::move(call->request),
-                        std::move(call->response), std::move(call->status));
+                    finishCall(call);
                 }
+
+                startCalls();
             }
 
-            // It's not clear if gRPC guarantees any order for expired alarms,
-            // so we use 'pending' counter to ensure CQ shutdown happens last.
-            // https://github.com/grpc/grpc/issues/31398
-            if (shutdown && pending == 0) {
+            if (shutdown && waitHead == NULL && retrying == 0 &&
+                    !queueShutdown) {
                 queue.Shutdown();
+                queueShutdown = true;
             }
         }
     }
 
-    void stop()
-    {
-        gpr_timespec past{};
-        shutdownAlarm.Set(&queue, past, &shutdownAlarm);
-    }
+    struct Channel {
+        std::unique_ptr<grpc::GenericStub> stub;
+        size_t inFlight{0};
+    };
 
-private:
     struct ActiveCall {
-        grpc::Alarm sendAlarm;
-        bool sent;
+        std::atomic<ActiveCall*> next;
+
+        // ClientContext can't be reused, so it's recreated in place
+        std::aligned_storage<sizeof(grpc::ClientContext),
+            alignof(grpc::ClientContext)>::type contextBuf;
 
-        grpc::ClientContext context;
-        Request request;
-        Response response;
+        grpc::ByteBuffer request;
+        grpc::ByteBuffer response;
         grpc::Status status;
-        std::unique_ptr<grpc::ClientAsyncResponseReader<Response>>
+        std::unique_ptr<grpc::ClientAsyncResponseReader<grpc::ByteBuffer>>
             responseReader;
 
+        RequestCb getRequest;
         ResponseCb cb;
+
+        Channel* channel;
+
+        grpc::Alarm retryAlarm;
+        bool retrying{false};
+
+        grpc::ClientContext* context()
+        {
+            return (grpc::ClientContext*)&contextBuf;
+        }
+    };
+
+    // Intrusive multi-producer single-consumer queue by Dmitry Vyukov.
+    class CallQueue {
+    public:
+        CallQueue()
+        {
+            dummy.next = NULL;
+        }
+
+        void push(ActiveCall* call)
+        {
+            call->next.store(NULL, std::memory_order_relaxed);
+            auto prev = head.exchange(call, std::memory_order_acq_rel);
+            prev->next.store(call, std::memory_order_release);
+        }
+
+        // may return NULL while push() is in progress,
+        // but then the pushing side will post a wakeup
+        ActiveCall* pop()
+        {
+            auto first = tail;
+            auto next = first->next.load(std::memory_order_acquire);
+
+            if (first == &dummy) {
+                if (next == NULL) {
+                    return NULL;
+                }
+                tail = first = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+
+            if (next) {
+                tail = next;
+                return first;
+            }
+
+            if (first != head.load(std::memory_order_acquire)) {
+                return NULL;
+            }
+
+            push(&dummy);
+
+            next = first->next.load(std::memory_order_acquire);
+            if (next) {
+                tail = next;
+                return first;
+            }
+
+            return NULL;
+        }
+
+    private:
+        ActiveCall dummy;
+        std::atomic<ActiveCall*> head{&dummy};
+        ActiveCall* tail{&dummy};
     };
 
+    static constexpr const char* TraceExportMethod =
+        "/opentelemetry.proto.collector.trace.v1.TraceService/Export";
+    static constexpr const char* MetricsExportMethod =
+        "/opentelemetry.proto.collector.metrics.v1.MetricsService/Export";
+    static constexpr const char* LogsExportMethod =
+        "/opentelemetry.proto.collector.logs.v1.LogsService/Export";
+
+    static const char* getExportMethod(Signal signal)
+    {
+        switch (signal) {
+        case Signal::Metrics:
+            return MetricsExportMethod;
+        case Signal::Logs:
+            return LogsExportMethod;
+        default:
+            return TraceExportMethod;
+        }
+    }
+
+    // calls over the in-flight limit wait in submission order
+    void startCalls()
+    {
+        while (auto call = submitted.pop()) {
+            addWaiting(call);
+        }
+
+        while (waitHead && inFlight < maxInFlight) {
+            auto call = waitHead;
+            waitHead = call->next.load(std::memory_order_relaxed);
+
+            startCall(call);
+        }
+    }
+
+    void addWaiting(ActiveCall* call)
+    {
+        call->next.store(NULL, std::memory_order_relaxed);
+
+        if (waitHead) {
+            waitTail->next.store(call, std::memory_order_relaxed);
+        } else {
+            waitHead = call;
+        }
+        waitTail = call;
+    }
+
+    void startCall(ActiveCall* call)
+    {
+        // least loaded channel
+        auto channel = &channels[0];
+        for (auto& ch : channels) {
+            if (ch.inFlight < channel->inFlight) {
+                channel = &ch;
+            }
+        }
+
+        call->channel = channel;
+        channel->inFlight++;
+        inFlight++;
+
+        auto context = new (&call->contextBuf) grpc::ClientContext();
+
+        for (auto& header : headers) {
+            context->AddMetadata(header.first, header.second);
+        }
+
+        auto req = call->getRequest();
+        grpc::Slice slice(req.data(), req.size(),
+            grpc::Slice::STATIC_SLICE);
+        call->request = grpc::ByteBuffer(&slice, 1);
+
+        call->responseReader = channel->stub->PrepareUnaryCall(
+            context, exportMethod, call->request, &queue);
+        call->responseReader->StartCall();
+        call->responseReader->Finish(
+            &call->response, &call->status, call);
+    }
+
+    void finishCall(ActiveCall* call)
+    {
+        call->channel->inFlight--;
+        inFlight--;
+
+        auto delay = call->cb(std::move(call->response),
+            std::move(call->status));
+
+        call->responseReader.reset();
+        call->context()->~ClientContext();
+        call->request.Clear();
+        call->response.Clear();
+        call->status = grpc::Status();
+
+        if (delay.count() >= 0 && !shutdown) {
+            call->retrying = true;
+            retrying++;
+
+            call->retryAlarm.Set(&queue,
+                std::chrono::system_clock::now() + delay, call);
+            return;
+        }
+
+        releaseCall(call);
+    }
+
+    void retryCall(ActiveCall* call, bool ok)
+    {
+        call->retrying = false;
+        retrying--;
+
+        // cancelled on shutdown
+        if (!ok) {
+            call->cb(grpc::ByteBuffer(), grpc::Status(
+                grpc::StatusCode::CANCELLED, "exporter is stopped"));
+            releaseCall(call);
+            return;
+        }
+
+        addWaiting(call);
+    }
+
+    void releaseCall(ActiveCall* call)
+    {
+        call->getRequest = nullptr;
+        call->cb = nullptr;
+
+        auto head = returnedCalls.load(std::memory_order_relaxed);
+        do {
+            call->next.store(head, std::memory_order_relaxed);
+        } while (!returnedCalls.compare_exchange_weak(head, call,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    const char* const exportMethod;
+
     Target::HeaderVec headers;
 
-    std::unique_ptr<TraceService::Stub> stub;
+    std::vector<Channel> channels;
     grpc::CompletionQueue queue;
 
-    grpc::Alarm shutdownAlarm;
-    std::atomic<int> pending{0};
+    // owned by worker thread
+    const size_t maxInFlight;
+    size_t inFlight{0};
+    ActiveCall* waitHead{NULL};
+    ActiveCall* waitTail{NULL};
+    size_t retrying{0};
     bool shutdown{false};
+    bool queueShutdown{false};
+
+    CallQueue submitted;
+
+    grpc::Alarm wakeAlarm;
+    std::atomic<bool> wakeSet{false};
+
+    grpc::Alarm shutdownAlarm;
+
+    // owned by sending thread, returned calls are taken all at once
+    std::vector<std::unique_ptr<ActiveCall>> calls;
+    ActiveCall* freeCalls{NULL};
+    std::atomic<ActiveCall*> returnedCalls{NULL};
+
+    std::thread worker;
 };
@@ -56,6 +56,7 @@ def nginx_config(request, pytestconfig, testdir, logger):
         + f"error_log {testdir}/error.log info;\n"
         + f"load_module {os.path.abspath(pytestconfig.option.module)};\n"
         + pytestconfig.option.globals
+        + params.get("globals", "")
     )
     params["http_globals"] = f"root {testdir};\n" + "access_log off;\n"
     conf = tmpl.render(params)
@@ -1,6 +1,8 @@
 from collections import namedtuple
 import niquests
 import pytest
+import re
+import signal
 import socket
 import time
 import urllib3
@@ -32,6 +34,11 @@ http {
     otel_trace on;
     {{ resource_attrs }}
 
+    upstream retry {
+        server 127.0.0.1:1 max_fails=0;
+        server 127.0.0.1:18080 backup;
+    }
+
     server {
         listen       127.0.0.1:18443 ssl;
         listen       127.0.0.1:18443 quic;
@@ -56,6 +63,7 @@ http {
             otel_span_attr http.response.header.content.type
                 $sent_http_content_type;
             otel_span_attr http.request $request;
+            otel_span_attr my.const "constant";
             return 200 "OK";
         }
 
@@ -65,6 +73,7 @@ http {
             add_header "X-Otel-Span-Id" $otel_span_id;
             add_header "X-Otel-Parent-Id" $otel_parent_id;
             add_header "X-Otel-Parent-Sampled" $otel_parent_sampled;
+            add_header "X-Otel-Baggage-Tenant" $otel_baggage_tenant_id;
             return 204;
         }
 
@@ -87,10 +96,95 @@ http {
             proxy_pass http://127.0.0.1:18080/notrace;
         }
 
+        location /b3 {
+            otel_trace_context propagate b3 b3multi jaeger;
+            proxy_pass http://127.0.0.1:18080/notrace;
+        }
+
+        location /jaeger {
+            otel_trace_context extract jaeger b3;
+            proxy_pass http://127.0.0.1:18080/notrace;
+        }
+
+        location /upstream {
+            otel_trace_context inject;
+            otel_upstream_spans on;
+            proxy_pass http://retry/notrace;
+        }
+
+        location /phases {
+            otel_phase_events on;
+            proxy_pass http://127.0.0.1:18080/notrace;
+        }
+
+        location /red {
+            otel_metrics on;
+            return 204;
+        }
+
+        location /logs {
+            otel_logs error;
+            proxy_pass http://127.0.0.1:1;
+        }
+
+        location /sampler {
+            otel_trace_context extract;
+            otel_sampler parent_based ratio=0;
+            return 204;
+        }
+
+        location /ratio {
+            otel_sampler ratio=1;
+            return 204;
+        }
+
+        location /limited {
+            otel_sampler rate_limit=2;
+            return 204;
+        }
+
+        location /override {
+            otel_trace off;
+            otel_trace_override error latency=10s;
+            return 500 "ERR";
+        }
+
+        location /exporter {
+            otel_trace off;
+            return 200 "$otel_batch_size $otel_batch_interval";
+        }
+
+        location /slow {
+            limit_rate 100;
+        }
+
         location /notrace {
             otel_trace off;
             add_header "X-Otel-Traceparent" $http_traceparent;
             add_header "X-Otel-Tracestate" $http_tracestate;
+            add_header "X-Otel-B3" $http_b3;
+            add_header "X-Otel-B3-Traceid" $http_x_b3_traceid;
+            add_header "X-Otel-B3-Spanid" $http_x_b3_spanid;
+            add_header "X-Otel-B3-Sampled" $http_x_b3_sampled;
+            add_header "X-Otel-Uber-Trace-Id" $http_uber_trace_id;
+            return 204;
+        }
+    }
+
+    server {
+        listen       127.0.0.1:18085;
+
+        location /limited {
+            otel_sampler rate_limit=2;
+            return 204;
+        }
+    }
+
+    server {
+        listen       127.0.0.1:18086;
+
+        location /limited {
+            otel_sampler rate_limit=2;
             return 204;
         }
     }
@@ -185,6 +279,8 @@ def test_custom_attributes(client, trace_service):
     value = get_attr(span, "http.response.header.content.type")
     assert value.values[0].string_value == "text/plain"
     assert get_attr(span, "http.request") == "GET /custom HTTP/1.1"
+    assert get_attr(span, "my.const") == "constant"
+    assert get_attr(span, "http.route") == "/custom"
 
 
 def test_trace_off(client, trace_service):
@@ -211,6 +307,57 @@ def test_variables(client, trace_service, parent):
     assert r.headers.get("X-Otel-Parent-Sampled") == ("1" if parent else "0")
 
 
+def test_baggage(client, trace_service):
+    r = client.get(
+        "http://127.0.0.1:18080/vars",
+        headers={"Baggage": "userId=alice, tenant-id = acme%20corp;p=1"},
+    )
+    assert r.headers.get("X-Otel-Baggage-Tenant") == "acme corp"
+
+    trace_service.get_span()
+
+
+@pytest.mark.parametrize(
+    "traceparent",
+    [
+        "00-0af7651916cd43dd8448eb211c80319c-b9c7c989f97918e1-0",
+        "01-0af7651916cd43dd8448eb211c80319c-b9c7c989f97918e1-01",
+        "00-0af7651916cd43dd8448eb211c80319g-b9c7c989f97918e1-01",
+        "00-0af7651916cd43dd8448eb211c80319c_b9c7c989f97918e1-01",
+        "00-0af7651916cd43dd8448eb211c80319c-b9c7c989f97918e1-01x",
+    ],
+)
+def test_malformed_context(client, trace_service, traceparent):
+    r = client.get(
+        "http://127.0.0.1:18080/vars", headers={"Traceparent": traceparent}
+    )
+
+    span = trace_service.get_span()
+    assert span.trace_id.hex() != parent_ctx.trace_id
+    assert span.parent_span_id == b""
+
+    assert r.headers.get("X-Otel-Parent-Sampled") == "0"
+
+
+@pytest.mark.parametrize(
+    "nginx_config", [{"globals": "worker_processes 4;"}], indirect=True
+)
+def test_unique_ids(trace_service, nginx):
+    trace_ids, span_ids = set(), set()
+
+    # new connection for each request to spread them over workers
+    for _ in range(200):
+        r = niquests.get("http://127.0.0.1:18080/vars")
+        trace_ids.add(r.headers["X-Otel-Trace-Id"])
+        span_ids.add(r.headers["X-Otel-Span-Id"])
+
+    assert len(trace_ids) == 200
+    assert len(span_ids) == 200
+
+    time.sleep(0.3)  # wait for the last request to be flushed
+    trace_service.batches.clear()
+
+
 @pytest.mark.parametrize("parent", [None, parent_ctx])
 @pytest.mark.parametrize(
     "path", ["/ignore", "/extract", "/inject", "/propagate"]
@@ -240,6 +387,131 @@ def test_context(client, trace_service, parent, path):
     assert r.headers.get("X-Otel-Tracestate") == headers["Tracestate"]
 
 
+@pytest.mark.parametrize(
+    "headers, trace_id",
+    [
+        (
+            {"B3": f"{parent_ctx.trace_id}-{parent_ctx.span_id}-1"},
+            parent_ctx.trace_id,
+        ),
+        (
+            {
+                "X-B3-TraceId": parent_ctx.trace_id[16:],
+                "X-B3-SpanId": parent_ctx.span_id,
+                "X-B3-Sampled": "1",
+            },
+            "0" * 16 + parent_ctx.trace_id[16:],
+        ),
+        (
+            {
+                "Uber-Trace-Id": f"{parent_ctx.trace_id}:"
+                f"{parent_ctx.span_id}:0:1"
+            },
+            parent_ctx.trace_id,
+        ),
+        (trace_headers(parent_ctx), None),  # w3c is not enabled
+        (
+            # neither 64-bit nor 128-bit trace ID
+            {"B3": f"{parent_ctx.trace_id[8:]}-{parent_ctx.span_id}-1"},
+            None,
+        ),
+    ],
+)
+def test_b3_jaeger_context(client, trace_service, headers, trace_id):
+    r = client.get("http://127.0.0.1:18080/b3", headers=headers)
+
+    span = trace_service.get_span()
+
+    if trace_id:
+        assert span.trace_id.hex() == trace_id
+        assert span.parent_span_id.hex() == parent_ctx.span_id
+    else:
+        assert span.parent_span_id == b""
+
+    ids = (span.trace_id.hex(), span.span_id.hex())
+
+    assert r.headers.get("X-Otel-Traceparent") is None
+    assert r.headers.get("X-Otel-B3") == "{}-{}-1".format(*ids)
+    assert r.headers.get("X-Otel-B3-Traceid") == ids[0]
+    assert r.headers.get("X-Otel-B3-Spanid") == ids[1]
+    assert r.headers.get("X-Otel-B3-Sampled") == "1"
+    assert r.headers.get("X-Otel-Uber-Trace-Id") == "{}:{}:0:01".format(*ids)
+
+
+def test_context_format_order(client, trace_service):
+    headers = {
+        "B3": f"{'1' * 32}-{parent_ctx.span_id}-1",
+        "Uber-Trace-Id": f"{parent_ctx.trace_id}:{parent_ctx.span_id}:0:1",
+    }
+
+    r = client.get("http://127.0.0.1:18080/jaeger", headers=headers)
+    assert r.status_code == 204
+
+    span = trace_service.get_span()
+    assert span.trace_id.hex() == parent_ctx.trace_id
+
+
+def test_upstream_spans(client, trace_service):
+    r = client.get("http://127.0.0.1:18080/upstream")
+    assert r.status_code == 204
+
+    spans = trace_service.get_batch().scope_spans[0].spans
+    assert len(spans) == 3
+
+    server = next(s for s in spans if s.kind == 2)  # SPAN_KIND_SERVER
+    attempts = {
+        get_attr(s, "net.sock.peer.port"): s for s in spans if s.kind == 3
+    }
+
+    for span in attempts.values():
+        assert span.trace_id == server.trace_id
+        assert span.parent_span_id == server.span_id
+        assert get_attr(span, "net.sock.peer.addr") == "127.0.0.1"
+        assert span.start_time_unix_nano >= server.start_time_unix_nano
+        assert span.end_time_unix_nano <= server.end_time_unix_nano
+
+    failed, ok = attempts[1], attempts[18080]
+
+    assert get_attr(failed, "http.status_code") == 502
+    assert failed.status.code == 2  # STATUS_CODE_ERROR
+    assert failed.end_time_unix_nano <= ok.start_time_unix_nano
+
+    assert get_attr(ok, "http.status_code") == 204
+    assert get_attr(ok, "nginx.upstream.header_time") >= 0
+
+    # upstream request is created for the first attempt
+    assert r.headers.get("X-Otel-Traceparent") == (
+        f"00-{server.trace_id.hex()}-{failed.span_id.hex()}-01"
+    )
+
+
+def test_phase_events(client, trace_service):
+    r = client.post("http://127.0.0.1:18080/phases", data="body")
+    assert r.status_code == 204
+
+    span = trace_service.get_span()
+    events = [(e.name, e.time_unix_nano) for e in span.events]
+
+    assert [name for name, _ in events] == [
+        "nginx.request_header_read",
+        "nginx.request_body_read",
+        "nginx.preaccess_done",
+        "nginx.access_done",
+        "nginx.response_header",
+        "nginx.response_end",
+    ]
+
+    for _, time in events:
+        assert span.start_time_unix_nano <= time <= span.end_time_unix_nano
+
+    times = dict(events)
+    assert (
+        times["nginx.access_done"]
+        <= times["nginx.request_body_read"]
+        <= times["nginx.response_header"]
+    )
+
+
 @pytest.mark.parametrize(
     "nginx_config",
     [{"interval": "200ms", "endpoint": "http://127.0.0.1:14317"}],
@@ -269,6 +541,228 @@ def test_batches(client, trace_service, batch_count):
     trace_service.batches.clear()
 
 
+@pytest.mark.parametrize(
+    "nginx_config",
+    [{"interval": "200ms", "exporter_opts": "channels 2; max_in_flight 1;"}],
+    indirect=True,
+)
+def test_max_in_flight(client, trace_service):
+    for _ in range(7):  # 2 batches and 1 request to trigger sending
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    time.sleep(0.05)
+
+    assert len(trace_service.batches) == 2
+
+    time.sleep(0.3)  # wait for the last request to be flushed
+    trace_service.batches.clear()
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [{"exporter_opts": "metrics_interval 100ms; metrics_exemplars on;"}],
+    indirect=True,
+)
+def test_metrics(client, trace_service):
+    for _ in range(3):
+        assert client.get("http://127.0.0.1:18080/red").status_code == 204
+        span = trace_service.get_span()
+
+    # metrics are updated along with the last span
+    trace_service.metrics.batches.clear()
+
+    metrics = trace_service.metrics.get_metrics()
+
+    histogram = metrics["http.server.duration"].exponential_histogram
+    (point,) = histogram.data_points
+    assert get_attr(point, "http.route") == "/red"
+    assert get_attr(point, "http.method") == "GET"
+    assert get_attr(point, "nginx.status_class") == "2xx"
+    assert point.count == 3
+    assert point.start_time_unix_nano < point.time_unix_nano
+
+    (exemplar,) = point.exemplars
+    assert exemplar.trace_id == span.trace_id
+    assert exemplar.span_id == span.span_id
+
+    (requests,) = metrics["nginx.http.requests"].sum.data_points
+    assert requests.as_int == 3
+    assert metrics["nginx.http.requests"].sum.is_monotonic
+
+
+def test_logs(client, trace_service):
+    assert client.get("http://127.0.0.1:18080/logs").status_code == 502
+
+    span = trace_service.get_span()
+
+    (record,) = [
+        r
+        for r in trace_service.logs.get_records()
+        if r.body.string_value.startswith("connect() failed")
+    ]
+    assert record.trace_id == span.trace_id
+    assert record.span_id == span.span_id
+    assert record.severity_text == "error"
+    assert record.severity_number == 17  # SEVERITY_NUMBER_ERROR
+    assert record.flags == 1
+    assert "client: 127.0.0.1" in record.body.string_value
+
+    trace_service.logs.batches.clear()
+
+
+def test_sampler(client, trace_service):
+    # root request is dropped by ratio, while child follows the parent
+    for parent in [None, parent_ctx]:
+        r = client.get(
+            "http://127.0.0.1:18080/sampler", headers=trace_headers(parent)
+        )
+        assert r.status_code == 204
+
+    span = trace_service.get_span()
+    assert span.trace_id.hex() == parent_ctx.trace_id
+    assert span.trace_state == parent_ctx.state
+
+    assert client.get("http://127.0.0.1:18080/ratio").status_code == 204
+
+    span = trace_service.get_span()
+    assert span.name == "/ratio"
+    assert span.trace_state == "ot=th:0"
+
+
+def test_rate_limit(client, trace_service):
+    # burst takes a second worth of spans
+    for _ in range(5):
+        assert client.get("http://127.0.0.1:18080/limited").status_code == 204
+
+    time.sleep(0.1)  # wait for spans
+
+    spans = []
+    while len(trace_service.batches):
+        spans += trace_service.batches.pop()[0].scope_spans[0].spans
+
+    assert len(spans) == 2
+    assert get_attr(spans[0], "nginx.sampling.probability") == 1.0
+
+
+def test_rate_limit_unnamed_servers(client, trace_service):
+    # servers without server_name have buckets of their own
+    for port in [18085, 18086]:
+        for _ in range(2):
+            r = client.get(f"http://127.0.0.1:{port}/limited")
+            assert r.status_code == 204
+
+    time.sleep(0.1)  # wait for spans
+
+    spans = []
+    while len(trace_service.batches):
+        spans += trace_service.batches.pop()[0].scope_spans[0].spans
+
+    assert len(spans) == 4
+
+
+def test_trace_override(client, trace_service):
+    assert client.get("http://127.0.0.1:18080/override").status_code == 500
+
+    span = trace_service.get_span()
+    assert span.name == "/override"
+    assert get_attr(span, "nginx.sampling.override") == "error"
+    assert span.flags & 0xFF == 1  # sampled
+
+
+def test_retry(client, trace_service):
+    trace_service.failures = 1
+
+    assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    time.sleep(1.1)  # max backoff of the first retry
+
+    assert trace_service.get_span().name == "/ok"
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [
+        {
+            "interval": "1s",
+            "exporter_opts": """
+                adaptive on;
+                min_batch_size 2;
+                min_interval 10ms;
+            """,
+        }
+    ],
+    indirect=True,
+)
+def test_adaptive_batching(client, trace_service):
+    # idle worker waits for small batch to fill
+    r = client.get("http://127.0.0.1:18080/exporter")
+    assert r.text == "2 1000"
+
+    for _ in range(2):
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    time.sleep(0.1)  # well before the max interval
+
+    batch = trace_service.get_batch()
+    assert len(batch.scope_spans[0].spans) == 2
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [{"interval": "2s", "exporter_opts": "priority_reserve 1;"}],
+    indirect=True,
+)
+@pytest.mark.parametrize("trace_service", ["skip_otelcol"], indirect=True)
+def test_priority_spans(client, trace_service):
+    trace_service.delay = 0.5
+
+    # 2 batches are in flight, the last buffer takes 2 spans and keeps
+    # the last one for error spans, the second error span evicts /ok one
+    for _ in range(9):
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    for _ in range(2):
+        assert client.get("http://127.0.0.1:18080/err").status_code == 500
+
+    trace_service.delay = 0
+
+    spans = []
+    for _ in range(300):
+        while len(trace_service.batches):
+            spans += trace_service.batches.pop()[0].scope_spans[0].spans
+        if len(spans) == 9:
+            break
+        time.sleep(0.01)
+
+    names = [span.name for span in spans]
+    assert names.count("/err") == 2
+    assert names.count("/ok") == 7
+
+
+@pytest.mark.parametrize(
+    "nginx_config", [{"exporter_opts": "spill_dir spill;"}], indirect=True
+)
+def test_spill(client, trace_service):
+    trace_service.failures = 100
+
+    # 2 batches are retried, the last one is spilled
+    for _ in range(3):
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+        time.sleep(0.05)
+
+    trace_service.failures = 0
+
+    spans = []
+    for _ in range(200):
+        while len(trace_service.batches):
+            spans += trace_service.batches.pop()[0].scope_spans[0].spans
+        if len(spans) == 3:
+            break
+        time.sleep(0.01)
+
+    assert [span.name for span in spans] == ["/ok"] * 3
+
+
 @pytest.mark.parametrize(
     "nginx_config",
     [
@@ -329,3 +823,120 @@ def test_tls_export(client, trace_service):
     assert client.get("http://127.0.0.1:18080/ok").status_code == 200
 
     assert trace_service.get_span().name == "/ok"
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [
+        {
+            "endpoint": "127.0.0.1:14320",
+            "exporter_opts": "compression gzip;",
+        },
+        {
+            "endpoint": "127.0.0.1:14320",
+            "exporter_opts": "compression deflate;",
+        },
+    ],
+    indirect=True,
+)
+def test_compression(nginx_config, client, trace_service):
+    assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    assert trace_service.get_span().name == "/ok"
+
+    # HPACK literal of the first request on a connection
+    encoding = re.search(rb"compression (\w+);", nginx_config.encode())[1]
+    assert (
+        b"grpc-encoding" + bytes([len(encoding)]) + encoding
+        in trace_service.wire.requests
+    )
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [
+        {
+            "endpoint": "http://127.0.0.1:14319",
+            "exporter_opts": """
+                protocol http;
+                header X-API-TOKEN api.value;
+            """,
+        }
+    ],
+    indirect=True,
+)
+def test_http_export(client, trace_service):
+    assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    assert trace_service.get_span().name == "/ok"
+
+    assert dict(trace_service.last_metadata)["x-api-token"] == "api.value"
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [
+        {
+            "endpoint": "http://127.0.0.1:14319",
+            "interval": "500ms",
+            "exporter_opts": "protocol http;",
+        }
+    ],
+    indirect=True,
+)
+def test_http_export_reload(nginx, testdir, client, trace_service):
+    # takes a few seconds at the limited rate
+    (testdir / "slow").write_bytes(b"x" * 300)
+
+    with socket.create_connection(("127.0.0.1", 18080)) as slow:
+        slow.sendall(b"GET /slow HTTP/1.0\r\n\r\n")
+
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+        nginx.send_signal(signal.SIGHUP)
+
+        # the old worker completes it after its last flush interval
+        response = b""
+        while chunk := slow.recv(1024):
+            response += chunk
+
+        assert response.startswith(b"HTTP/1.1 200")
+
+    spans = []
+    for _ in range(300):
+        while len(trace_service.batches):
+            spans += trace_service.batches.pop()[0].scope_spans[0].spans
+        if len(spans) == 2:
+            break
+        time.sleep(0.01)
+
+    assert sorted(span.name for span in spans) == ["/ok", "/slow"]
+
+
+@pytest.mark.parametrize(
+    "nginx_config",
+    [
+        {
+            "globals": "worker_processes 2;",
+            "exporter_opts": "shared_zone 1m;",
+        },
+        {
+            "globals": "master_process off;",
+            "exporter_opts": "shared_zone 1m;",
+        },
+    ],
+    indirect=True,
+)
+def test_shared_exporter(client, trace_service):
+    for _ in range(4):
+        assert client.get("http://127.0.0.1:18080/ok").status_code == 200
+
+    spans = []
+    for _ in range(100):
+        while len(trace_service.batches):
+            spans += trace_service.batches.pop()[0].scope_spans[0].spans
+        if len(spans) == 4:
+            break
+        time.sleep(0.01)
+
+    assert [span.name for span in spans] == ["/ok"] * 4
@@ -0,0 +1,106 @@
+import socket
+
+
+NGINX_CONFIG = """
+{{ globals }}
+
+daemon off;
+
+events {
+}
+
+stream {
+    otel_trace on;
+
+    server {
+        listen 127.0.0.1:18081;
+        proxy_pass 127.0.0.1:18080;
+    }
+
+    server {
+        listen 127.0.0.1:18082;
+        otel_span_name refused;
+        proxy_pass 127.0.0.1:1;
+    }
+
+    server {
+        listen 127.0.0.1:18083;
+        otel_sampler ratio=0;
+        proxy_pass 127.0.0.1:18080;
+    }
+}
+
+http {
+    {{ http_globals }}
+
+    otel_exporter {
+        endpoint 127.0.0.1:14317;
+        interval 1ms;
+    }
+
+    server {
+        listen 127.0.0.1:18080;
+
+        location / {
+            return 200 "OK";
+        }
+    }
+}
+
+"""
+
+
+def get_attr(span, name):
+    for value in (a.value for a in span.attributes if a.key == name):
+        return getattr(value, value.WhichOneof("value"))
+
+
+def session(port):
+    with socket.create_connection(("127.0.0.1", port)) as s:
+        s.sendall(b"GET / HTTP/1.0\r\n\r\n")
+        data = b""
+        while chunk := s.recv(1024):
+            data += chunk
+        return data
+
+
+def test_session(nginx, trace_service):
+    response = session(18081)
+    assert response.startswith(b"HTTP/1.1 200")
+
+    span = trace_service.get_span()
+    assert span.name == "stream"
+    assert span.kind == 2  # SPAN_KIND_SERVER
+    assert span.status.code == 0
+    assert span.start_time_unix_nano < span.end_time_unix_nano
+
+    assert get_attr(span, "net.transport") == "ip_tcp"
+    assert get_attr(span, "net.host.port") == 18081
+    assert get_attr(span, "net.sock.peer.addr") == "127.0.0.1"
+    assert get_attr(span, "nginx.stream.status") == 200
+    assert get_attr(span, "nginx.stream.bytes_received") == 18
+    assert get_attr(span, "nginx.stream.bytes_sent") == len(response)
+    assert get_attr(span, "nginx.upstream.addr") == "127.0.0.1:18080"
+    assert get_attr(span, "nginx.upstream.connect_time") >= 0
+    assert get_attr(span, "nginx.upstream.bytes_sent") == 18
+    assert get_attr(span, "nginx.upstream.bytes_received") == len(response)
+
+
+def test_upstream_error(nginx, trace_service):
+    assert session(18082) == b""
+
+    span = trace_service.get_span()
+    assert span.name == "refused"
+    assert span.status.code == 2  # STATUS_CODE_ERROR
+    assert get_attr(span, "nginx.stream.status") == 502
+    assert get_attr(span, "nginx.upstream.connect_time") is None
+
+
+def test_sampler(nginx, trace_service):
+    assert session(18083).startswith(b"HTTP/1.1 200")
+
+    # the only span is of the next session
+    session(18081)
+
+    span = trace_service.get_span()
+    assert get_attr(span, "net.host.port") == 18081
@@ -1,16 +1,29 @@
 import concurrent
 import grpc
+import http.server
+from opentelemetry.proto.collector.logs.v1 import logs_service_pb2
+from opentelemetry.proto.collector.logs.v1 import logs_service_pb2_grpc
+from opentelemetry.proto.collector.metrics.v1 import metrics_service_pb2
+from opentelemetry.proto.collector.metrics.v1 import metrics_service_pb2_grpc
 from opentelemetry.proto.collector.trace.v1 import trace_service_pb2
 from opentelemetry.proto.collector.trace.v1 import trace_service_pb2_grpc
 import pytest
+import socket
 import subprocess
+import threading
 import time
 
 
 class TraceService(trace_service_pb2_grpc.TraceServiceServicer):
     batches = []
+    failures = 0
+    delay = 0
 
     def Export(self, request, context):
+        time.sleep(self.delay)
+        if self.failures:
+            self.failures -= 1
+            context.abort(grpc.StatusCode.UNAVAILABLE, "unavailable")
         self.batches.append(request.resource_spans)
         self.last_metadata = context.invocation_metadata()
         return trace_service_pb2.ExportTracePartialSuccess()
@@ -31,6 +44,111 @@ class TraceService(trace_service_pb2_grpc.TraceServiceServicer):
         return batch.scope_spans[0].spans.pop()
 
 
+class MetricsService(metrics_service_pb2_grpc.MetricsServiceServicer):
+    batches = []
+
+    def Export(self, request, context):
+        self.batches.append(request.resource_metrics)
+        return metrics_service_pb2.ExportMetricsPartialSuccess()
+
+    def get_metrics(self, timeout=1):
+        for _ in range(int(timeout * 100)):
+            if len(self.batches):
+                break
+            time.sleep(0.01)
+        assert len(self.batches)
+        batch = self.batches[-1]
+        assert len(batch) == 1
+        assert len(batch[0].scope_metrics) == 1
+        return {m.name: m for m in batch[0].scope_metrics[0].metrics}
+
+
+class LogsService(logs_service_pb2_grpc.LogsServiceServicer):
+    batches = []
+
+    def Export(self, request, context):
+        self.batches.append(request.resource_logs)
+        return logs_service_pb2.ExportLogsPartialSuccess()
+
+    def get_records(self):
+        for _ in range(100):
+            if len(self.batches):
+                break
+            time.sleep(0.01)
+        return [
+            record
+            for batch in self.batches
+            for scope_logs in batch[0].scope_logs
+            for record in scope_logs.log_records
+        ]
+
+
+class HttpTraceHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_POST(self):
+        request = trace_service_pb2.ExportTraceServiceRequest()
+        request.ParseFromString(
+            self.rfile.read(int(self.headers["Content-Length"]))
+        )
+        self.server.trace_service.batches.append(request.resource_spans)
+        self.server.trace_service.last_metadata = [
+            (k.lower(), v) for k, v in self.headers.items()
+        ]
+        body = trace_service_pb2.ExportTraceServiceResponse()
+        body = body.SerializeToString()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/x-protobuf")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+
+class WireRelay(threading.Thread):
+    """Forwards connections at 127.0.0.1:14320 to the collector port and
+    records the requests sent. gRPC servers take reserved headers, like
+    grpc-encoding, out of the metadata passed to services."""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.requests = b""
+        self.sock = socket.create_server(("127.0.0.1", 14320))
+
+    def run(self):
+        while True:
+            try:
+                client, _ = self.sock.accept()
+            except OSError:
+                return
+            upstream = socket.create_connection(("127.0.0.1", 14317))
+            threading.Thread(
+                target=self.pipe, args=(client, upstream, True), daemon=True
+            ).start()
+            threading.Thread(
+                target=self.pipe, args=(upstream, client, False), daemon=True
+            ).start()
+
+    def pipe(self, src, dst, record):
+        try:
+            while data := src.recv(65536):
+                if record:
+                    self.requests += data
+                dst.sendall(data)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def stop(self):
+        self.sock.close()
+
+
 @pytest.fixture(scope="module")
 def trace_service(request, pytestconfig, logger, cert):
     server = grpc.server(concurrent.futures.ThreadPoolExecutor())
@@ -38,6 +156,14 @@ def trace_service(request, pytestconfig, logger, cert):
     trace_service_pb2_grpc.add_TraceServiceServicer_to_server(
         trace_service, server
     )
+    trace_service.metrics = MetricsService()
+    metrics_service_pb2_grpc.add_MetricsServiceServicer_to_server(
+        trace_service.metrics, server
+    )
+    trace_service.logs = LogsService()
+    logs_service_pb2_grpc.add_LogsServiceServicer_to_server(
+        trace_service.logs, server
+    )
     trace_service.use_otelcol = (
         pytestconfig.option.otelcol
         and getattr(request, "param", "") != "skip_otelcol"
@@ -50,8 +176,19 @@ def trace_service(request, pytestconfig, logger, cert):
         listen_addr += " and 127.0.0.1:14318"
     logger.info(f"Starting trace service at {listen_addr}...")
     server.start()
+    http_server = http.server.ThreadingHTTPServer(
+        ("127.0.0.1", 14319), HttpTraceHandler
+    )
+    http_server.trace_service = trace_service
+    logger.info("Starting OTLP/HTTP trace service at 127.0.0.1:14319...")
+    threading.Thread(target=http_server.serve_forever, daemon=True).start()
+    trace_service.wire = WireRelay()
+    trace_service.wire.start()
     yield trace_service
     logger.info("Stopping trace service...")
+    trace_service.wire.stop()
+    http_server.shutdown()
+    http_server.server_close()
     server.stop(grace=None)
 
 
@@ -87,6 +224,12 @@ service:
     traces:
       receivers: [otlp, otlp/tls]
       exporters: [otlp]
+    metrics:
+      receivers: [otlp, otlp/tls]
+      exporters: [otlp]
+    logs:
+      receivers: [otlp, otlp/tls]
+      exporters: [otlp]
   telemetry:
     metrics:
       # prevent otelcol from opening 8888 port